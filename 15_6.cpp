@@ -1,3 +1,4 @@
+// 编译：g++ -std=c++17 -o 15_6 15_6.cpp http_conn.cpp -lpthread -lz
 #include<sys/socket.h>
 #include<netinet/in.h>
 #include<arpa/inet.h>
@@ -9,6 +10,10 @@
 #include<stdlib.h>
 #include<cassert>
 #include<sys/epoll.h>
+#include<ctype.h>
+#include<dirent.h>
+#include<string>
+#include<vector>
 
 #include "locker.h"
 #include "threadpool.h"
@@ -16,11 +21,44 @@
 
 #define MAX_FD 65536
 #define MAX_EVENT_NUMBER 10000
+#define SHUTDOWN_TIMEOUT_MS 10000 // 收到SIGTERM或SIGINT后等待连接上的请求处理完的最长时间
 
 // 引用http_conn.cpp中的函数
 // 添加、删除需要监听的文件描述符
 extern int addfd(int epollfd, int fd, bool one_shot);
 extern int removefd(int epollfd, int fd);
+extern int setnonblocking(int fd);
+
+// 统一事件源（见10_1.cpp）：信号处理函数只把信号值写入管道，由主循环处理
+static int sig_pipefd[2];
+
+void sig_handler(int sig){
+    int save_errno = errno;
+    int msg = sig;
+    send(sig_pipefd[1], (char*)&msg, 1, 0);
+    errno = save_errno;
+}
+
+// users中初始化过的下标
+// http_conn的构造函数什么也不做，users数组的内存要到对应的描述符第一次用作连接时才真正分配，
+// 没有初始化过的对象不能访问，所以停止时只遍历这里记下的下标。只由主线程修改；
+// 连接关闭后不清除，关闭过的连接的m_sockfd为-1，close_conn会忽略它
+class fd_bitmap{
+public:
+    void set(int fd){
+        m_words[fd / 64] |= 1ULL << (fd % 64);
+        if(fd >= m_end){ m_end = fd + 1; }
+    }
+    // 按从小到大的顺序对每个记下的下标调用f，只扫描到用过的最大描述符为止
+    template<typename F> void for_each(F f) const {
+        for(int w = 0; w * 64 < m_end; ++w){
+            for(unsigned long long bits = m_words[w]; bits; bits &= bits - 1){ f(w * 64 + __builtin_ctzll(bits)); }
+        }
+    }
+private:
+    unsigned long long m_words[MAX_FD / 64];
+    int m_end;
+};
 
 // 添加进程监听的信号，并设置其对应的处理函数
 void addsig(int sig, void(handler)(int), bool restart = true){
@@ -32,43 +70,282 @@ void addsig(int sig, void(handler)(int), bool restart = true){
     assert(sigaction(sig, &sa, NULL) != -1);
 }
 
+// 引用http_conn.cpp中的网站根目录
+extern const char* doc_root;
+
+// POST /upload/:name的消息体保存为上传目录下的name
+class upload_handler : public request_handler{
+    public:
+    explicit upload_handler(const std::string& dir): m_dir(dir){}
+
+    body_handler* on_post(const route_match& match, long /*content_length*/){
+        std::string name;
+        // 参数只匹配一级路径段，再排除隐藏文件和".."，就不会写到上传目录之外
+        if(!match.param("name", &name) || name[0] == '.'){ return NULL; }
+        return file_body_handler::create(m_dir + "/" + name);
+    }
+
+    private:
+    std::string m_dir;
+};
+
+// 目录下的文件列表
+// produce在主线程的write中调用，不能阻塞，所以读目录（以及必要时的fstatat）在工作线程调用on_get时就全部做完，
+// 只保存文件名和是否是目录，页面边发送边生成，转义后的HTML每个连接只占用一个分块的内存
+class dir_listing : public response_producer{
+    public:
+    // path是目录的路径，title是页面上显示的url
+    static dir_listing* create(const char* path, const std::string& title){
+        DIR* dir = opendir(path);
+        if(!dir){ return NULL; }
+        dir_listing* listing = new dir_listing(title.c_str());
+        while(struct dirent* entry = readdir(dir)){
+            const char* name = entry->d_name;
+            if(name[0] == '.'){ continue; } // 隐藏文件以及"."和".."
+            bool is_dir = (entry->d_type == DT_DIR);
+            if(entry->d_type == DT_UNKNOWN){
+                struct stat st;
+                is_dir = fstatat(dirfd(dir), name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+            }
+            listing->m_names.push_back(is_dir ? std::string(name) + '/' : std::string(name));
+        }
+        closedir(dir);
+        return listing;
+    }
+
+    const char* content_type() const { return "text/html; charset=utf-8"; }
+
+    long produce(char* buf, size_t size){
+        size_t len = 0;
+        while(len < size){
+            if(m_pos == m_pending.size()){
+                if(m_done){ break; }
+                m_pending.clear();
+                m_pos = 0;
+                next_entry();
+            }
+            size_t n = m_pending.size() - m_pos;
+            if(n > size - len){ n = size - len; }
+            memcpy(buf + len, m_pending.data() + m_pos, n);
+            m_pos += n;
+            len += n;
+        }
+        return len;
+    }
+
+    private:
+    explicit dir_listing(const char* url): m_next(0), m_pos(0), m_done(false){
+        m_pending = "<html><head><title>Index of ";
+        escape_html(url);
+        m_pending += "</title></head><body><h1>Index of ";
+        escape_html(url);
+        m_pending += "</h1><ul>\n";
+    }
+
+    // 把下一个目录项对应的一行放进m_pending，目录项都生成完时放入页面的结尾
+    // 目录的名字以'/'结尾，'/'本身不转义
+    void next_entry(){
+        if(m_next < m_names.size()){
+            const std::string& name = m_names[m_next++];
+            bool is_dir = name[name.size() - 1] == '/';
+            std::string base(name, 0, is_dir ? name.size() - 1 : name.size());
+            m_pending += "<li><a href=\"";
+            escape_url(base.c_str());
+            if(is_dir){ m_pending += '/'; }
+            m_pending += "\">";
+            escape_html(name.c_str());
+            m_pending += "</a></li>\n";
+            return;
+        }
+        m_pending += "</ul></body></html>\n";
+        m_done = true;
+    }
+
+    void escape_html(const char* text){
+        for(; *text; ++text){
+            switch(*text){
+                case '&':{ m_pending += "&amp;"; break; }
+                case '<':{ m_pending += "&lt;"; break; }
+                case '>':{ m_pending += "&gt;"; break; }
+                case '"':{ m_pending += "&quot;"; break; }
+                default:{ m_pending += *text; }
+            }
+        }
+    }
+
+    void escape_url(const char* text){
+        static const char* hex = "0123456789ABCDEF";
+        for(; *text; ++text){
+            unsigned char c = *text;
+            if(isalnum(c) || strchr("-._~", c)){ m_pending += c; }
+            else{
+                m_pending += '%';
+                m_pending += hex[c >> 4];
+                m_pending += hex[c & 15];
+            }
+        }
+    }
+
+    private:
+    std::vector<std::string> m_names; // 目录下的文件名，子目录以'/'结尾
+    size_t m_next;                    // 下一个要生成的目录项
+    std::string m_pending; // 已经生成、还没有交给http_conn的内容
+    size_t m_pos;
+    bool m_done;
+};
+
+// 网站根目录下的文件；-l打开时，以'/'结尾的url回复该目录下的文件列表
+class site_handler : public static_file_handler{
+    public:
+    site_handler(const char* root, bool list_dirs): static_file_handler(root), m_list_dirs(list_dirs){}
+
+    response_producer* on_get(const route_match& match){
+        if(!m_list_dirs){ return NULL; }
+        char path[http_conn::FILENAME_LEN];
+        if(!file_path(match, path, sizeof(path))){ return NULL; }
+        size_t len = strlen(path);
+        if(path[len - 1] != '/'){ return NULL; }
+        return dir_listing::create(path, std::string(match.url, strcspn(match.url, "?")));
+    }
+
+    private:
+    bool m_list_dirs;
+};
+
+// GET /api/status：当前的连接数
+class status_handler : public request_handler{
+    public:
+    response_producer* on_get(const route_match& /*match*/){
+        char json[64];
+        snprintf(json, sizeof(json), "{\"connections\":%d}\n",
+            http_conn::m_conn_stats.current.load(std::memory_order_relaxed));
+        return new string_producer(json, "application/json");
+    }
+};
+
+// GET /metrics：Prometheus文本格式的运行指标
+class metrics_handler : public request_handler{
+    public:
+    response_producer* on_get(const route_match& /*match*/){
+        std::string text;
+        http_conn::render_metrics(&text);
+        return new string_producer(text, "text/plain; version=0.0.4");
+    }
+};
+
+// GET /api/files/:name：网站根目录下某个文件的大小和修改时间
+class file_info_handler : public request_handler{
+    public:
+    response_producer* on_get(const route_match& match){
+        std::string name;
+        if(!match.param("name", &name) || name[0] == '.'){ return NULL; }
+        struct stat st;
+        if(stat_cache::instance()->stat((std::string(doc_root) + "/" + name).c_str(), &st) < 0 || !S_ISREG(st.st_mode)){
+            return NULL;
+        }
+        char json[128];
+        snprintf(json, sizeof(json), "{\"size\":%lld,\"mtime\":%lld}\n", (long long)st.st_size, (long long)st.st_mtime);
+        return new string_producer(json, "application/json");
+    }
+};
+
 void show_error(int connfd, const char* info){
-    printf("%s", info);
+    LOG_WARN("%s", info);
     send(connfd, info, strlen(info), 0);
     close(connfd);
 }
 
 int main(int argc, char* argv[]){
-    if(argc <= 2){
-        printf("usage: %s IP PORT\n", basename(argv[0]));
+    // -c 指定文件映射缓存的容量（MB），为0则不缓存
+    // -s 用sendfile发送文件内容，而不是把文件mmap后用writev发送
+    // -z 指定gzip压缩数据缓存的容量（MB），为0则总是发送原文件
+    // -u 接受POST /upload/name上传的文件，保存到指定的目录中
+    // -l 以'/'结尾的url回复目录下的文件列表
+    // -a 把访问日志追加到指定的文件，收到SIGHUP时重新打开它
+    // -w 线程池采用工作窃取调度，而不是共用一个请求队列
+    // -A 线程池按连接分派，同一个连接上的请求总是由同一个线程处理
+    // -p 把线程池中的线程绑定到CPU上
+    int cache_mb = file_cache::DEFAULT_CAPACITY / (1024 * 1024);
+    int gzip_mb = file_cache::DEFAULT_GZIP_CAPACITY / (1024 * 1024);
+    bool use_sendfile = false;
+    bool list_dirs = false;
+    std::string upload_dir;
+    const char* access_log_path = NULL;
+    threadpool<http_conn>::SCHEDULE schedule = threadpool<http_conn>::SHARED_QUEUE;
+    bool pin_threads = false;
+    int opt = 0;
+    while((opt = getopt(argc, argv, "c:sz:u:la:wAp")) != -1){
+        switch(opt){
+            case 'c':{ cache_mb = atoi(optarg); break; }
+            case 's':{ use_sendfile = true; break; }
+            case 'z':{ gzip_mb = atoi(optarg); break; }
+            case 'u':{ upload_dir = optarg; break; }
+            case 'l':{ list_dirs = true; break; }
+            case 'a':{ access_log_path = optarg; break; }
+            case 'w':{ schedule = threadpool<http_conn>::WORK_STEALING; break; }
+            case 'A':{ schedule = threadpool<http_conn>::AFFINITY; break; }
+            case 'p':{ pin_threads = true; break; }
+            default:{
+                printf("usage: %s [-c cache_mb] [-s] [-z gzip_mb] [-u upload_dir] [-l] [-a access_log] [-w | -A] [-p] IP PORT\n", basename(argv[0]));
+                return 1;
+            }
+        }
+    }
+    if(argc - optind < 2){
+        printf("usage: %s [-c cache_mb] [-s] [-z gzip_mb] [-u upload_dir] [-l] [-a access_log] [-w | -A] [-p] IP PORT\n", basename(argv[0]));
+        return 1;
+    }
+
+    const char* ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
+    file_cache::instance()->set_capacity((size_t)cache_mb * 1024 * 1024);
+    file_cache::instance()->set_sendfile(use_sendfile);
+    file_cache::instance()->set_gzip_capacity((size_t)gzip_mb * 1024 * 1024);
+    if(access_log_path && !access_log::instance()->open(access_log_path)){
+        LOG_ERROR("cannot open access log %s, errno is: %d", access_log_path, errno);
         return 1;
     }
 
-    const char* ip = argv[1];
-    int port = atoi(argv[2]);
+    // 固定的路径段优先于参数和前缀，所以/api和/upload下的url不会落到网站根目录的文件上
+    site_handler site(doc_root, list_dirs);
+    status_handler status;
+    file_info_handler file_info;
+    metrics_handler metrics_page;
+    upload_handler upload(upload_dir);
+    router routes;
+    routes.add("/*", &site);
+    routes.add("/api/status", &status);
+    routes.add("/api/files/:name", &file_info);
+    routes.add("/metrics", &metrics_page);
+    if(!upload_dir.empty()){ routes.add("/upload/:name", &upload); }
+    http_conn::set_router(&routes);
 
     addsig(SIGPIPE, SIG_IGN); // 忽略SIGPIPE信号
 
     threadpool<http_conn>* pool = NULL; // 创建线程池
     try{
-        pool = new threadpool<http_conn>;
+        pool = new threadpool<http_conn>(8, 10000, schedule, pin_threads);
     }
     catch(...){ return 1; }
 
     // 预先为每个可能的客户连接分配一个http_conn对象
+    // 读写缓冲区和请求、应答用到的数组都不在http_conn对象内，而是处理请求时才从buffer_pool获取，所以这个数组本身不大
     http_conn* users = new http_conn[MAX_FD];
     assert(users);
+    static fd_bitmap used_fds; // 静态存储，初始全为0
     int user_count = 0;
 
     int listenfd = socket(PF_INET, SOCK_STREAM, 0);
     assert(listenfd >= 0);
 
     // 参考5.11.4节
-    // close系统调用将立即返回，TCP模块将丢弃被关闭的socket对应的TCP发送缓冲区中残留的数据
+    // 如果设置SO_LINGER为{1, 0}，close系统调用将立即返回，TCP模块将丢弃被关闭的socket对应的TCP发送缓冲区中残留的数据
     // 同时给对方发送一个复位报文段（见3.5.2小节）。
-    // 因此，这种情况给服务器提供了异常终止连接的方法
-    struct linger tmp = {1, 0}; 
-    setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
+    // 连接socket会继承监听socket的这个选项，"Connection: close"的大文件应答在write()发完最后一块后立即close，
+    // 还留在发送缓冲区里的尾部数据就会被丢弃，所以这里不再设置它，使用默认的优雅关闭
+    // 优雅关闭后主动关闭的一方会进入TIME_WAIT状态，设置SO_REUSEADDR以便服务器重启时能立即重新bind
+    int reuse = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
     int ret = 0;
     struct sockaddr_in address;
@@ -84,35 +361,90 @@ int main(int argc, char* argv[]){
     assert(ret >= 0);
 
     epoll_event events[MAX_EVENT_NUMBER];
+    // 一轮事件中读好了请求的连接，处理完所有事件后一次交给线程池，整批只唤醒一次睡眠的线程
+    static http_conn* ready[MAX_EVENT_NUMBER];
     int epollfd = epoll_create(5);
     assert(epollfd != -1);
     addfd(epollfd, listenfd, false);
     http_conn::m_epollfd = epollfd; // 所有http_conn对象共享该值
 
-    while(1){
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sig_pipefd);
+    assert(ret != -1);
+    setnonblocking(sig_pipefd[1]);
+    addfd(epollfd, sig_pipefd[0], false);
+    addsig(SIGHUP, sig_handler); // 日志轮转
+    addsig(SIGTERM, sig_handler); // 优雅退出
+    addsig(SIGINT, sig_handler);
+
+    // 收到SIGTERM或SIGINT后不再接受新连接，关闭空闲的连接，其余连接发完当前的应答就关闭，
+    // 所有连接都关闭或超过SHUTDOWN_TIMEOUT_MS后退出主循环；再收到一次信号时立即退出
+    bool stopping = false;
+    long long stop_start = 0;
+    long long stop_deadline = 0;
+    while(!stopping || (http_conn::m_conn_stats.current.load(std::memory_order_relaxed) > 0 && metrics::now_us() < stop_deadline)){
+        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, stopping ? 100 : -1);
         if((number < 0) && (errno != EINTR)){
-            printf("epoll failure\n");
+            LOG_ERROR("epoll failure");
             break;
         }
 
+        int ready_count = 0;
         for(int i=0; i<number; ++i){
             int sockfd = events[i].data.fd;
             if(sockfd == listenfd){
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_addrlength);
-                if(connfd < 0){
-                    printf("errno is : %d\n", errno);
-                    continue;
+                if(stopping){ continue; } // 监听socket已经在处理这一轮的信号时关闭了
+                // 监听socket是边沿触发的，一次事件可能对应多个已完成的连接，要一直accept到EAGAIN，
+                // 否则剩下的连接要等到下一个新连接到来时才会被接受
+                while(true){
+                    struct sockaddr_in client_address;
+                    socklen_t client_addrlength = sizeof(client_address);
+                    int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_addrlength);
+                    if(connfd < 0){
+                        if(errno != EAGAIN && errno != EWOULDBLOCK){ LOG_WARN("accept failed, errno is: %d", errno); }
+                        break;
+                    }
+                    // users按文件描述符下标，连接数没有达到上限时描述符也可能超出数组
+                    if(http_conn::m_conn_stats.current.load(std::memory_order_relaxed) >= MAX_FD || connfd >= MAX_FD){
+                        http_conn::m_conn_stats.rejected.fetch_add(1, std::memory_order_relaxed);
+                        show_error(connfd, "Internal server busy");
+                        continue;
+                    }
+                    // 初始化客户连接
+                    users[connfd].init(connfd, client_address);
+                    used_fds.set(connfd);
                 }
-                if(http_conn::m_user_count >= MAX_FD){
-                    show_error(connfd, "Internal server busy");
-                    continue;
+            }
+            else if(sockfd == sig_pipefd[0] && (events[i].events & EPOLLIN)){
+                char signals[1024];
+                ret = recv(sig_pipefd[0], signals, sizeof(signals), 0);
+                for(int j = 0; j < ret; ++j){
+                    switch(signals[j]){
+                        case SIGHUP:{
+                            access_log::instance()->reopen();
+                            LOG_INFO("reopening access log");
+                            break;
+                        }
+                        case SIGTERM:
+                        case SIGINT:{
+                            if(stopping){
+                                stop_deadline = 0;
+                                break;
+                            }
+                            stopping = true;
+                            stop_start = metrics::now_us();
+                            stop_deadline = stop_start + SHUTDOWN_TIMEOUT_MS * 1000LL;
+                            removefd(epollfd, listenfd);
+                            http_conn::m_draining.store(true);
+                            // 空闲的连接没有交给线程池，可以直接关闭
+                            used_fds.for_each([users](int fd){
+                                if(users[fd].idle()){ users[fd].close_conn(); }
+                            });
+                            LOG_INFO("shutting down, waiting for %d connections",
+                                http_conn::m_conn_stats.current.load(std::memory_order_relaxed));
+                            break;
+                        }
+                    }
                 }
-                // 初始化客户连接
-                users[connfd].init(connfd, client_address);
-
             }
             else if(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
                 // 如果有异常，直接关闭客户连接
@@ -120,20 +452,37 @@ int main(int argc, char* argv[]){
             }
             else if(events[i].events & EPOLLIN){
                 // 根据读的结果决定是将任务添加到请求队列，还是关闭连接
-                if(users[sockfd].read()){ pool->append(users + sockfd); }
+                if(users[sockfd].read()){ ready[ready_count++] = users + sockfd; }
                 else{ users[sockfd].close_conn(); }
             }
             else if(events[i].events & EPOLLOUT){
                 // 根据写的结果决定是否关闭连接
                 if(!users[sockfd].write()){ users[sockfd].close_conn(); }
+                // 流水线中的后续请求已经在读缓冲区里了，直接交给线程池处理
+                else if(users[sockfd].has_buffered_request()){ ready[ready_count++] = users + sockfd; }
             }
             else{}
         }
+        // 请求队列满了，放不进去的连接不会再有事件（EPOLLONESHOT），只能关闭
+        size_t queued = pool->append_batch(ready, ready_count);
+        if(queued < (size_t)ready_count){
+            LOG_WARN("request queue is full, closing %d connections", ready_count - (int)queued);
+            for(int j = queued; j < ready_count; ++j){ ready[j]->close_conn(); }
+        }
     }
 
+    if(stopping){
+        LOG_INFO("connections drained in %lld ms, %d still open", (metrics::now_us() - stop_start) / 1000,
+            http_conn::m_conn_stats.current.load(std::memory_order_relaxed));
+    }
+    // 先停止线程池，之后就不会有工作线程再访问users，可以关闭剩下的连接
+    long long remaining = (stop_deadline - metrics::now_us()) / 1000;
+    pool->shutdown(remaining > 0 ? (int)remaining : 0);
+    used_fds.for_each([users](int fd){ users[fd].close_conn(); });
     close(epollfd);
-    close(listenfd);
+    if(!stopping){ close(listenfd); }
     delete [] users;
     delete pool;
+    logger::instance()->flush();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,93 @@
+// 访问日志
+// 每个应答一行，采用Common Log Format再加上发送的字节数之后的耗时（微秒）：
+// 127.0.0.1 - - [10/Oct/2023:13:55:36 +0800] "GET /index.html HTTP/1.1" 200 2326 153
+// 工作线程在填充应答时就把前半行格式化好，应答发完后由主线程补上字节数和耗时，交给log_channel批量写出
+// 轮转日志时先把文件改名，再给服务器发SIGHUP，它会在后台线程中重新打开原来的文件名
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "log.h"
+
+class access_log{
+    public:
+    static const int MAX_URL = 1024;  // 记录的url的最大长度，超过的部分被截掉
+    static const int MAX_LINE = MAX_URL * 2 + 160; // 一行日志的最大长度，url中的每个字符最多转义成两个
+    // 访问日志几乎都由主线程写出，它一个缓冲区要容纳所有连接的日志，所以比诊断日志的大得多：
+    // 每秒数万个应答时也能撑过几个写出周期，后台线程来不及写时才丢弃
+    static const size_t RING_SIZE = 4 * 1024 * 1024;
+
+    static access_log* instance(){
+        static access_log* log = new access_log;
+        return log;
+    }
+
+    // 启动时调用，打开失败返回false，没有打开时不记录访问日志
+    bool open(const char* path){
+        log_channel* channel = new log_channel(-1, RING_SIZE);
+        if(!channel->open(path)){ return false; }
+        m_channel = channel;
+        return true;
+    }
+
+    bool enabled() const { return m_channel != 0; }
+
+    // 因缓冲区满而没有写出的行数
+    unsigned long dropped() const { return m_channel ? m_channel->dropped() : 0; }
+
+    // 重新打开日志文件，可以在主循环收到SIGHUP时调用
+    void reopen(){
+        if(m_channel){ m_channel->reopen(); }
+    }
+
+    // 一行中发完应答之前就能确定的部分，即字节数之前的内容，写入buf并返回长度，buf至少要有MAX_LINE字节
+    // url中的'"'、'\\'和控制字符被转义，以免破坏日志格式
+    static int format_prefix(char* buf, const sockaddr_in& addr, const char* method, const char* url, int status){
+        char ip[INET_ADDRSTRLEN];
+        if(!inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip))){ strcpy(ip, "-"); }
+        int len = snprintf(buf, MAX_LINE, "%s - - [%s] \"%s ", ip, now(), method);
+        const char* p = url ? url : "-";
+        for(int i = 0; p[i] && i < MAX_URL; ++i){
+            unsigned char c = p[i];
+            if(c == '"' || c == '\\'){ buf[len++] = '\\'; }
+            buf[len++] = (c < 0x20 || c == 0x7f) ? '?' : c;
+        }
+        len += snprintf(buf + len, MAX_LINE - len, " HTTP/1.1\" %d ", status);
+        return len;
+    }
+
+    // 补上字节数和耗时，作为完整的一行写出
+    void append(const char* prefix, int len, long bytes, long latency_us){
+        char line[MAX_LINE + 48];
+        memcpy(line, prefix, len);
+        len += snprintf(line + len, sizeof(line) - len, "%ld %ld\n", bytes, latency_us);
+        m_channel->append(line, len);
+    }
+
+    private:
+    access_log(): m_channel(0){}
+
+    // "10/Oct/2023:13:55:36 +0800"，同一秒内只格式化一次
+    static const char* now(){
+        static thread_local time_t last_sec = -1;
+        static thread_local char date[32];
+        time_t sec = time(NULL);
+        if(sec != last_sec){
+            struct tm tm;
+            localtime_r(&sec, &tm);
+            strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", &tm);
+            last_sec = sec;
+        }
+        return date;
+    }
+
+    private:
+    log_channel* m_channel;
+};
+
+#endif
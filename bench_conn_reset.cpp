@@ -0,0 +1,92 @@
+// 比较保持连接上每处理完一批请求重置http_conn的开销
+// 旧做法：init()把2KB读缓冲区、1KB写缓冲区和200字节的目标文件路径全部memset为0
+// 新做法：解析只依赖下标，重置时只需把几个下标和指针清零，缓冲区和请求、应答用到的数组归还给buffer_pool
+// 直接使用http_conn.cpp中的http_conn：每个连接先真正解析并应答一个很小的GET请求，
+// 再像finish_write那样调用reset_write()和init()进入空闲状态，只计重置的时间
+// 模拟服务器上大量连接轮流收到请求的情况，每次重置的都是不在缓存中的另一个连接
+// 编译：g++ -std=gnu++17 -O2 -o bench_conn_reset bench_conn_reset.cpp http_conn.cpp -lpthread -lz
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<sys/socket.h>
+#include<sys/epoll.h>
+#include<x86intrin.h>
+
+#include "http_conn.h"
+
+// http_conn中把它声明为友元，这里可以调用私有的解析、应答和重置函数
+class conn_reset_bench{
+public:
+    // 让连接处于处理完一个请求、应答还没有归还的状态，和write()发完一批之后、finish_write()之前一样
+    static void serve(http_conn* c){
+        static const char request[] = "GET /index.html HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n";
+        c->m_idle = false;
+        if(!c->grow_read_buf()){ abort(); }
+        memcpy(c->m_read_buf, request, sizeof(request) - 1);
+        c->m_read_idx = sizeof(request) - 1;
+        http_conn::HTTP_CODE ret = c->process_read();
+        if(!c->process_write(ret)){ abort(); }
+        c->m_keep_alive = c->m_linger;
+        c->finish_request();
+        c->m_bytes_have_send += c->m_bytes_to_send;
+        c->m_bytes_to_send = 0;
+    }
+
+    // finish_write中进入空闲状态的部分
+    static void reset(http_conn* c){
+        c->reset_write();
+        c->m_idle = true;
+        c->init();
+    }
+
+    // 原来的init()还要清零整个读写缓冲区和目标文件路径
+    static void reset_memset(http_conn* c){
+        memset(c->m_read_buf, '\0', http_conn::READ_BUFFER_SIZE);
+        memset(c->m_write_buf, '\0', http_conn::WRITE_BUFFER_SIZE);
+        memset(c->m_request->real_file, '\0', http_conn::FILENAME_LEN);
+        reset(c);
+    }
+};
+
+static double run(http_conn* conns, int n, int rounds, void (*reset)(http_conn*)){
+    unsigned long long cycles = 0;
+    for(int r = 0; r < rounds; ++r){
+        for(int i = 0; i < n; ++i){
+            conn_reset_bench::serve(&conns[i]);
+            unsigned long long start = __rdtsc();
+            reset(&conns[i]);
+            cycles += __rdtsc() - start;
+        }
+    }
+    return (double)cycles / ((double)n * rounds);
+}
+
+int main(int argc, char* argv[]){
+    int n = (argc > 1) ? atoi(argv[1]) : 10000; // 连接数，http_conn对象加上它们轮流使用的缓冲区远大于CPU缓存
+    int rounds = (argc > 2) ? atoi(argv[2]) : 20;
+
+    // init需要一个真实的socket和epoll描述符，所有连接共用同一个socket，只是不会真正收发数据
+    int fds[2];
+    if(socketpair(PF_UNIX, SOCK_STREAM, 0, fds) < 0){ return 1; }
+    http_conn::m_epollfd = epoll_create(5);
+    sockaddr_in addr;
+    memset(&addr, '\0', sizeof(addr));
+
+    http_conn* conns = new http_conn[n];
+    for(int i = 0; i < n; ++i){ conns[i].init(fds[0], addr); }
+
+    // 先各跑一轮预热，让页面和buffer_pool的空闲链表都已经准备好
+    run(conns, n, 1, conn_reset_bench::reset_memset);
+    run(conns, n, 1, conn_reset_bench::reset);
+
+    double old_cycles = run(conns, n, rounds, conn_reset_bench::reset_memset);
+    double new_cycles = run(conns, n, rounds, conn_reset_bench::reset);
+    printf("connections: %d, rounds: %d, sizeof(http_conn): %zu\n", n, rounds, sizeof(http_conn));
+    printf("memset reset: %8.1f cycles/request\n", old_cycles);
+    printf("O(1) reset:   %8.1f cycles/request  x%.1f\n", new_cycles, old_cycles / new_cycles);
+
+    delete [] conns;
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
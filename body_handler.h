@@ -0,0 +1,75 @@
+// 请求消息体的流式处理
+// http_conn不再等整个消息体都读进读缓冲区才处理，而是每读到一块就交给body_handler，处理完的数据立即从读缓冲区移走
+// 所以无论上传多大，每个连接占用的内存都不超过读缓冲区的上限；分块编码的消息体在交给body_handler之前已经解开
+#ifndef BODY_HANDLER_H
+#define BODY_HANDLER_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string>
+
+class body_handler{
+    public:
+    virtual ~body_handler(){}
+    // 按顺序收到消息体的下一块数据，返回false表示处理失败，服务器回复500并关闭连接
+    virtual bool on_data(const char* data, size_t len) = 0;
+    // 消息体全部收到，返回false表示处理失败，服务器回复500
+    // 没有调用on_end就被销毁说明请求中途出错或连接已经关闭，body_handler应在析构函数中撤销已经做的事
+    virtual bool on_end() = 0;
+};
+
+// 把消息体写入文件：先写到path加".part"的临时文件中，完整收到之后才改名为path，中途失败时删除临时文件
+class file_body_handler : public body_handler{
+    public:
+    // 临时文件创建失败时返回NULL
+    static file_body_handler* create(const std::string& path){
+        std::string temp = path + ".part";
+        int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0){ return NULL; }
+        return new file_body_handler(path, temp, fd);
+    }
+
+    ~file_body_handler(){
+        if(m_fd >= 0){
+            close(m_fd);
+            unlink(m_temp.c_str());
+        }
+    }
+
+    bool on_data(const char* data, size_t len){
+        while(len > 0){
+            ssize_t ret = ::write(m_fd, data, len);
+            if(ret < 0){
+                if(errno == EINTR){ continue; }
+                return false;
+            }
+            data += ret;
+            len -= ret;
+        }
+        return true;
+    }
+
+    bool on_end(){
+        int fd = m_fd;
+        m_fd = -1;
+        if(close(fd) < 0 || rename(m_temp.c_str(), m_path.c_str()) < 0){
+            unlink(m_temp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    private:
+    file_body_handler(const std::string& path, const std::string& temp, int fd): m_path(path), m_temp(temp), m_fd(fd){}
+
+    private:
+    std::string m_path;
+    std::string m_temp;
+    int m_fd;
+};
+
+#endif
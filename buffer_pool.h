@@ -0,0 +1,107 @@
+// 连接缓冲区池
+// 按1KB、2KB、4KB……64KB分成若干个大小级别，每个级别维护一条空闲链表
+// 连接只在需要时才从池中取缓冲区，空闲时归还，这样大量保持连接但没有请求的客户不再各自占着几KB内存
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "locker.h"
+
+class buffer_pool{
+    public:
+    static const int MIN_SIZE = 1024;           // 最小的大小级别
+    static const int MAX_SIZE = 64 * 1024;      // 最大的大小级别，超过它的请求分配失败
+    static const int CLASS_NUMBER = 7;          // 1KB到64KB共7个级别
+    static const int MAX_FREE_BYTES = 4 * 1024 * 1024; // 每个级别最多缓存的空闲字节数，多出的直接还给系统
+
+    static buffer_pool* instance(){
+        static buffer_pool pool;
+        return &pool;
+    }
+
+    // 分配至少size字节的缓冲区，*real_size中返回向上取整后的实际大小，size超过MAX_SIZE时返回NULL
+    char* alloc(int size, int* real_size){
+        int idx = size_class(size);
+        if(idx < 0){ return NULL; }
+        *real_size = MIN_SIZE << idx;
+
+        free_list& list = m_lists[idx];
+        list.lock.lock();
+        free_node* node = list.head;
+        if(node){
+            list.head = node->next;
+            list.count--;
+        }
+        list.lock.unlock();
+
+        if(node){ return (char*)node; }
+        return (char*)malloc(*real_size);
+    }
+
+    // 归还alloc得到的缓冲区，size是alloc返回的实际大小
+    void free(char* buf, int size){
+        if(!buf){ return; }
+        int idx = size_class(size);
+        free_list& list = m_lists[idx];
+        list.lock.lock();
+        if(list.count < MAX_FREE_BYTES / size){
+            free_node* node = (free_node*)buf;
+            node->next = list.head;
+            list.head = node;
+            list.count++;
+            buf = NULL;
+        }
+        list.lock.unlock();
+        if(buf){ ::free(buf); }
+    }
+
+    // 把缓冲区扩大到至少size字节，保留前used字节的内容
+    // 成功时返回新缓冲区并释放旧缓冲区，失败时返回NULL，旧缓冲区保持不变
+    char* grow(char* buf, int* buf_size, int used, int size){
+        int real_size = 0;
+        char* new_buf = alloc(size, &real_size);
+        if(!new_buf){ return NULL; }
+        memcpy(new_buf, buf, used);
+        free(buf, *buf_size);
+        *buf_size = real_size;
+        return new_buf;
+    }
+
+    private:
+    struct free_node{ free_node* next; };
+
+    struct free_list{
+        free_list(): head(NULL), count(0){}
+        locker lock;
+        free_node* head;
+        int count;
+    };
+
+    buffer_pool(){}
+
+    ~buffer_pool(){
+        for(int i = 0; i < CLASS_NUMBER; ++i){
+            while(m_lists[i].head){
+                free_node* node = m_lists[i].head;
+                m_lists[i].head = node->next;
+                ::free(node);
+            }
+        }
+    }
+
+    // 返回能容纳size字节的最小级别
+    static int size_class(int size){
+        int idx = 0;
+        while((MIN_SIZE << idx) < size){
+            if(++idx >= CLASS_NUMBER){ return -1; }
+        }
+        return idx;
+    }
+
+    private:
+    free_list m_lists[CLASS_NUMBER];
+};
+
+#endif
@@ -0,0 +1,92 @@
+// Chase-Lev工作窃取双端队列（按Lê等人给出的C11内存序实现，容量固定）
+// 只有拥有它的线程能在底部push和pop，后进先出，刚放进去的任务相关的数据多半还在这个核的缓存里；
+// 其它线程从顶部steal最早放进去的任务。双方只在争抢最后一个元素时才需要CAS
+// 元素是一个T*和一个附带的整数，分别用原子变量保存，窃取者读到正在被覆盖的槽位时其CAS必然失败，读到的值会被丢弃
+#ifndef CHASE_LEV_DEQUE_H
+#define CHASE_LEV_DEQUE_H
+
+#include <atomic>
+
+template <typename T>
+class chase_lev_deque{
+    public:
+    // 容量向上取到2的幂
+    explicit chase_lev_deque(long capacity){
+        long size = 2;
+        while(size < capacity){ size <<= 1; }
+        m_buffer = new cell[size];
+        m_mask = size - 1;
+        m_top.store(0, std::memory_order_relaxed);
+        m_bottom.store(0, std::memory_order_relaxed);
+    }
+
+    ~chase_lev_deque(){ delete[] m_buffer; }
+
+    // 只能由拥有者调用，队列满时返回false
+    bool push(T* item, long long tag){
+        long b = m_bottom.load(std::memory_order_relaxed);
+        long t = m_top.load(std::memory_order_acquire);
+        if(b - t > m_mask){ return false; }
+        cell& c = m_buffer[b & m_mask];
+        c.item.store(item, std::memory_order_relaxed);
+        c.tag.store(tag, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // 只能由拥有者调用，取出最后放进去的元素，队列空时返回false
+    bool pop(T** item, long long* tag){
+        long b = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long t = m_top.load(std::memory_order_relaxed);
+        if(t > b){
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        read(b, item, tag);
+        if(t < b){ return true; }
+        // 只剩一个元素，与窃取者争抢
+        bool won = m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+
+    // 任何线程都可以调用，取出最早放进去的元素；队列空或者与其它线程争抢失败时返回false
+    bool steal(T** item, long long* tag){
+        long t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long b = m_bottom.load(std::memory_order_acquire);
+        if(t >= b){ return false; }
+        read(t, item, tag);
+        return m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return m_top.load(std::memory_order_relaxed) >= m_bottom.load(std::memory_order_relaxed);
+    }
+
+    private:
+    chase_lev_deque(const chase_lev_deque&);
+    chase_lev_deque& operator=(const chase_lev_deque&);
+
+    struct cell{
+        std::atomic<T*> item;
+        std::atomic<long long> tag;
+    };
+
+    void read(long index, T** item, long long* tag) const {
+        const cell& c = m_buffer[index & m_mask];
+        *item = c.item.load(std::memory_order_relaxed);
+        *tag = c.tag.load(std::memory_order_relaxed);
+    }
+
+    cell* m_buffer;
+    long m_mask;
+    alignas(64) std::atomic<long> m_top;    // 窃取者修改
+    alignas(64) std::atomic<long> m_bottom; // 拥有者修改
+    char m_pad[64 - sizeof(std::atomic<long>)];
+};
+
+#endif
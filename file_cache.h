@@ -0,0 +1,485 @@
+// 打开文件/内存映射缓存
+// 以目标文件的完整路径为键，让所有连接共享同一份mmap映射，热点文件不必每个请求都stat+open+mmap+munmap
+// 映射采用引用计数，被淘汰（或文件已被修改）的映射要等最后一个使用者释放后才真正munmap
+// 使用sendfile发送文件时，缓存保存的是打开的文件描述符而不是映射，此时缓存项的个数也有上限，
+// 不超过进程文件描述符上限的一部分，免得小文件占满描述符，连accept都失败
+// 另有一个独立限额的LRU缓存保存文件的gzip压缩版本：优先读入同目录下的.gz文件，没有时用zlib压缩一次
+// 哈希表按路径分成若干个分片，各有一把锁，不同文件的命中和释放很少争用同一把锁
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <functional>
+#include <unordered_map>
+#include <atomic>
+#include <zlib.h>
+
+#include "locker.h"
+#include "stat_cache.h"
+
+// 缓存中的一个文件
+struct file_entry{
+    std::string path;   // 文件的完整路径，即哈希表的键
+    struct stat st;     // 建立映射时文件的状态，用于size/mtime校验
+    char* addr;         // 文件被mmap到内存中的起始位置，空文件或sendfile模式下为NULL；压缩版本则是malloc得到的压缩数据
+    int fd;             // sendfile模式下打开的文件描述符，否则为-1
+    int refcnt;         // 正在使用该映射的请求数，与cached一起由所在分片的锁保护
+    bool cached;        // 是否还挂在缓存的哈希表和LRU链表上
+    int shard;          // 所在的分片
+    bool compressed;    // 是否是压缩版本，此时st.st_size是压缩后的大小
+    struct stat origin; // 压缩版本对应的原文件状态，原文件被修改后要重新压缩
+    time_t checked;     // 上一次用stat校验文件是否被修改的时间
+    char etag[64];          // 由inode、大小和修改时间生成的实体标签，含两端的引号
+    char last_modified[32]; // HTTP-date格式的修改时间，用于Last-Modified头部
+    file_entry* prev;   // LRU链表，表头是最近使用的文件
+    file_entry* next;
+};
+
+class file_cache{
+    public:
+    static const size_t DEFAULT_CAPACITY = 64 * 1024 * 1024;      // 默认最多缓存64MB的映射
+    static const int DEFAULT_REVALIDATE = 1;                      // 默认每秒最多stat校验一次
+    static const size_t DEFAULT_GZIP_CAPACITY = 16 * 1024 * 1024; // 默认最多缓存16MB的压缩数据
+    static const off_t MIN_GZIP_SIZE = 256;                       // 更小的文件压缩后省不了多少，直接发送原文件
+    static const int SENDFILE_FD_SHARE = 4;                       // sendfile模式下缓存最多占用文件描述符上限的1/4
+
+    // 所有工作线程共享同一个缓存
+    static file_cache* instance(){
+        static file_cache cache;
+        return &cache;
+    }
+
+    // capacity是缓存映射的总字节数上限，为0表示不缓存；单个文件超过上限的1/4时也不缓存，只为本次请求映射
+    void set_capacity(size_t capacity){
+        m_mapped.set_capacity(capacity);
+        trim(m_mapped);
+    }
+
+    // capacity是缓存压缩数据的总字节数上限，为0表示不提供压缩版本；超过上限1/4的文件不压缩
+    void set_gzip_capacity(size_t capacity){
+        m_gzip.set_capacity(capacity);
+        trim(m_gzip);
+    }
+
+    // 为true时缓存打开的文件描述符供sendfile使用，不再建立映射，应在启动时、第一个请求到来之前设置
+    // 缓存项的个数限制为RLIMIT_NOFILE的1/SENDFILE_FD_SHARE
+    void set_sendfile(bool use_sendfile){
+        m_sendfile = use_sendfile;
+        size_t max_entries = 0;
+        struct rlimit limit;
+        if(use_sendfile && getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY){
+            max_entries = limit.rlim_cur / SENDFILE_FD_SHARE;
+            if(max_entries == 0){ max_entries = 1; }
+        }
+        m_mapped.max_entries.store(max_entries);
+        trim(m_mapped);
+    }
+
+    // 命中的缓存项在revalidate秒内不再stat，超过后才重新比较size和mtime，为0则每次都校验
+    void set_revalidate(int revalidate){ m_revalidate = revalidate; }
+
+    // 获取path对应文件的映射，st中填入文件的状态
+    // 文件不存在时返回NULL且st->st_mode为0；文件存在但不是其他用户可读的普通文件时返回NULL，st中为其状态
+    // 返回的映射用完后必须调用release
+    file_entry* acquire(const char* path, struct stat* st){
+        time_t now = time(NULL);
+        std::string key(path);
+        file_entry* stale = NULL;
+
+        shard& s = m_mapped.shards[shard_index(key)];
+        s.lock.lock();
+        std::unordered_map<std::string, file_entry*>::iterator it = s.files.find(key);
+        if(it != s.files.end()){
+            file_entry* entry = it->second;
+            if(now - entry->checked < m_revalidate){
+                // 命中，且最近校验过，不需要任何系统调用
+                hit(s, entry, now, st);
+                s.lock.unlock();
+                return entry;
+            }
+            // 需要重新校验，stat放在锁外进行，先持有一个引用防止映射被释放
+            stale = entry;
+            stale->refcnt++;
+        }
+        s.lock.unlock();
+
+        // 文件状态来自stat_cache，文件没有变化时不需要系统调用，不存在的文件也是如此
+        struct stat cur;
+        if(stat_cache::instance()->stat(path, &cur) < 0){
+            if(stale){ release(stale); }
+            memset(st, '\0', sizeof(*st));
+            return NULL;
+        }
+
+        if(stale){
+            if(same_file(stale->st, cur)){
+                s.lock.lock();
+                if(stale->cached){
+                    stale->refcnt--; // hit会重新加上这个引用
+                    hit(s, stale, now, st);
+                    s.lock.unlock();
+                    return stale;
+                }
+                s.lock.unlock();
+            }
+            else{
+                // 文件已被修改，旧映射从缓存中摘除，等正在使用它的请求结束后再释放
+                s.lock.lock();
+                if(stale->cached){ detach(stale); }
+                s.lock.unlock();
+            }
+            release(stale);
+        }
+
+        *st = cur;
+        if(!(cur.st_mode & S_IROTH) || !S_ISREG(cur.st_mode)){ return NULL; }
+        return load(key, st, now);
+    }
+
+    // 获取source的gzip压缩版本，source是acquire得到且还没有release的文件
+    // 有预先压缩好的path.gz时用它，否则只有compressible为true（文本类文件）时才用zlib压缩
+    // 没有压缩版本、文件太小、压缩后省不了多少或者超过缓存限额时返回NULL，应发送原文件
+    // 压缩版本按原文件的状态校验，source被修改后（acquire已经换成了新的缓存项）会重新生成
+    // 返回的缓存项同样用release释放
+    file_entry* acquire_gzip(const file_entry* source, bool compressible){
+        if(source->st.st_size < MIN_GZIP_SIZE){ return NULL; }
+        if((size_t)source->st.st_size > m_gzip.max_file_size.load(std::memory_order_relaxed)){ return NULL; }
+
+        shard& s = m_gzip.shards[source->shard];
+        s.lock.lock();
+        std::unordered_map<std::string, file_entry*>::iterator it = s.files.find(source->path);
+        if(it != s.files.end()){
+            file_entry* entry = it->second;
+            if(same_file(entry->origin, source->st)){
+                // 以前已经确定这个文件不值得压缩
+                if(!entry->addr){
+                    s.lock.unlock();
+                    return NULL;
+                }
+                entry->refcnt++;
+                unlink(s, entry);
+                link_front(s, entry);
+                s.lock.unlock();
+                return entry;
+            }
+            detach(entry);
+        }
+        s.lock.unlock();
+
+        return load_gzip(source, compressible);
+    }
+
+    // 释放acquire或acquire_gzip得到的缓存项
+    void release(file_entry* entry){
+        if(!entry){ return; }
+        shard& s = cache_of(entry).shards[entry->shard];
+        s.lock.lock();
+        bool dead = (--entry->refcnt == 0) && !entry->cached;
+        s.lock.unlock();
+        if(dead){ destroy(entry); }
+    }
+
+    private:
+    static const int SHARDS = 16; // 每个缓存的分片数
+
+    // 一个分片：哈希表和LRU链表，锁同时保护其中各缓存项的引用计数
+    struct alignas(64) shard{
+        shard(): head(NULL), tail(NULL), size(0){}
+        locker lock;
+        std::unordered_map<std::string, file_entry*> files;
+        file_entry* head;
+        file_entry* tail;
+        size_t size; // 这个分片缓存的字节数
+    };
+
+    // 一个LRU缓存，映射和压缩数据各用一个
+    // 每个分片各自维护LRU链表，字节数和缓存项个数的限额由所有分片共用，超过时轮流淘汰各分片表尾的缓存项，
+    // 所以只在分片内部严格按LRU的顺序淘汰
+    struct lru_cache{
+        lru_cache(size_t cap): size(0), count(0), max_entries(0), next_victim(0){ set_capacity(cap); }
+        void set_capacity(size_t cap){
+            capacity.store(cap);
+            max_file_size.store(cap / 4);
+        }
+        shard shards[SHARDS];
+        std::atomic<size_t> size;          // 当前缓存的总字节数
+        std::atomic<size_t> count;         // 当前的缓存项个数
+        std::atomic<size_t> capacity;      // 总字节数上限
+        std::atomic<size_t> max_file_size; // 能进入缓存的单个文件的最大字节数
+        std::atomic<size_t> max_entries;   // 缓存项个数的上限，为0表示只按字节数限制
+        std::atomic<unsigned> next_victim; // 下一次从哪个分片淘汰
+    };
+
+    file_cache(): m_mapped(DEFAULT_CAPACITY), m_gzip(DEFAULT_GZIP_CAPACITY), m_revalidate(DEFAULT_REVALIDATE),
+        m_sendfile(false){}
+
+    ~file_cache(){
+        for(int i = 0; i < SHARDS; ++i){
+            while(m_mapped.shards[i].tail){ detach(m_mapped.shards[i].tail); }
+            while(m_gzip.shards[i].tail){ detach(m_gzip.shards[i].tail); }
+        }
+    }
+
+    static int shard_index(const std::string& path){ return std::hash<std::string>()(path) % SHARDS; }
+
+    static bool same_file(const struct stat& a, const struct stat& b){
+        return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_size == b.st_size
+            && a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+    }
+
+    lru_cache& cache_of(file_entry* entry){ return entry->compressed ? m_gzip : m_mapped; }
+
+    // 在分片s的锁内调用：增加引用并把缓存项移到LRU表头
+    static void hit(shard& s, file_entry* entry, time_t now, struct stat* st){
+        entry->refcnt++;
+        entry->checked = now;
+        unlink(s, entry);
+        link_front(s, entry);
+        *st = entry->st;
+    }
+
+    static file_entry* new_entry(const std::string& key, const struct stat& st, char* addr, int fd, time_t now){
+        file_entry* entry = new file_entry;
+        entry->path = key;
+        entry->st = st;
+        entry->addr = addr;
+        entry->fd = fd;
+        entry->refcnt = 1;
+        entry->cached = false;
+        entry->shard = shard_index(key);
+        entry->compressed = false;
+        entry->origin = st;
+        entry->checked = now;
+        entry->prev = entry->next = NULL;
+        make_validators(entry);
+        return entry;
+    }
+
+    // 缓存未命中，建立新的映射（或打开文件）并尝试放入缓存
+    // 文件在stat之后可能又被修改，所以打开后用fstat得到的状态为准，并写回st
+    file_entry* load(const std::string& key, struct stat* st, time_t now){
+        char* addr = NULL;
+        int fd = -1;
+        if(st->st_size > 0){
+            fd = open(key.c_str(), O_RDONLY);
+            if(fd < 0){ return NULL; }
+            if(fstat(fd, st) < 0){
+                close(fd);
+                return NULL;
+            }
+        }
+        if(st->st_size > 0){
+            if(!m_sendfile){
+                void* p = mmap(0, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                close(fd);
+                fd = -1;
+                if(p == MAP_FAILED){ return NULL; }
+                addr = (char*)p;
+            }
+        }
+
+        file_entry* entry = new_entry(key, *st, addr, fd, now);
+        insert(m_mapped, entry);
+        return entry;
+    }
+
+    // 生成source的压缩版本并放入缓存，不值得压缩时也缓存一个没有数据的缓存项，免得每次请求都重新尝试
+    file_entry* load_gzip(const file_entry* source, bool compressible){
+        size_t len = 0;
+        char* data = read_sibling(source, &len);
+        if(!data && compressible){ data = compress(source, &len); }
+        // 至少要省下1/8才值得让客户多做一次解压
+        if(data && (off_t)len > source->st.st_size - source->st.st_size / 8){
+            free(data);
+            data = NULL;
+        }
+
+        struct stat st = source->st;
+        st.st_size = data ? len : 0;
+        file_entry* entry = new_entry(source->path, st, data, -1, source->checked);
+        entry->compressed = true;
+        entry->origin = source->st;
+        // 压缩版本与原文件是不同的表示，实体标签不能相同
+        size_t etag_len = strlen(entry->etag);
+        snprintf(entry->etag + etag_len - 1, sizeof(entry->etag) - etag_len + 1, "-gz\"");
+
+        // 没有数据的缓存项不返回给调用者，放入缓存之前就去掉调用者的引用，之后它完全归缓存所有
+        if(!data){ entry->refcnt = 0; }
+        bool cached = insert(m_gzip, entry);
+        if(!data){
+            if(!cached){ destroy(entry); }
+            return NULL;
+        }
+        return entry;
+    }
+
+    // 读入同目录下预先压缩好的path.gz，它不能比原文件旧
+    static char* read_sibling(const file_entry* source, size_t* len){
+        std::string path = source->path + ".gz";
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0){ return NULL; }
+        struct stat st;
+        if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !(st.st_mode & S_IROTH) || st.st_size == 0
+            || st.st_mtime < source->st.st_mtime){
+            close(fd);
+            return NULL;
+        }
+        char* data = (char*)malloc(st.st_size);
+        off_t done = 0;
+        while(data && done < st.st_size){
+            ssize_t ret = pread(fd, data + done, st.st_size - done, done);
+            if(ret <= 0){
+                free(data);
+                data = NULL;
+                break;
+            }
+            done += ret;
+        }
+        close(fd);
+        *len = done;
+        return data;
+    }
+
+    // 用zlib把source压缩成gzip格式，sendfile模式下source没有映射，临时映射一下
+    static char* compress(const file_entry* source, size_t* len){
+        size_t size = source->st.st_size;
+        char* src = source->addr;
+        if(!src){
+            void* p = mmap(0, size, PROT_READ, MAP_PRIVATE, source->fd, 0);
+            if(p == MAP_FAILED){ return NULL; }
+            src = (char*)p;
+        }
+
+        char* data = NULL;
+        z_stream zs;
+        memset(&zs, '\0', sizeof(zs));
+        // windowBits加16表示输出gzip格式而不是zlib格式
+        if(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK){
+            uLong bound = deflateBound(&zs, size);
+            data = (char*)malloc(bound);
+            if(data){
+                zs.next_in = (Bytef*)src;
+                zs.avail_in = size;
+                zs.next_out = (Bytef*)data;
+                zs.avail_out = bound;
+                if(deflate(&zs, Z_FINISH) == Z_STREAM_END){ *len = zs.total_out; }
+                else{
+                    free(data);
+                    data = NULL;
+                }
+            }
+            deflateEnd(&zs);
+        }
+
+        if(!source->addr){ munmap(src, size); }
+        return data;
+    }
+
+    // 条件请求用到的ETag和Last-Modified只依赖文件状态，建立缓存项时生成一次，之后每个应答直接复制
+    static void make_validators(file_entry* entry){
+        const struct stat& st = entry->st;
+        unsigned long long mtime = (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+        snprintf(entry->etag, sizeof(entry->etag), "\"%llx-%llx-%llx\"",
+            (unsigned long long)st.st_ino, (unsigned long long)st.st_size, mtime);
+        struct tm tm;
+        gmtime_r(&st.st_mtime, &tm);
+        strftime(entry->last_modified, sizeof(entry->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    }
+
+    // 不持有任何锁时调用：把新的缓存项放进cache，缓存被禁用或文件超过单个文件的上限时不缓存
+    // 先放入再淘汰，总量可能暂时超出限额一个文件；返回是否放入了缓存
+    bool insert(lru_cache& cache, file_entry* entry){
+        size_t size = entry->st.st_size;
+        if(cache.capacity.load(std::memory_order_relaxed) == 0
+            || size > cache.max_file_size.load(std::memory_order_relaxed)){ return false; }
+        shard& s = cache.shards[entry->shard];
+        s.lock.lock();
+        // 其它线程可能同时加载了同一个文件，用新的缓存项替换它
+        std::unordered_map<std::string, file_entry*>::iterator it = s.files.find(entry->path);
+        if(it != s.files.end()){ detach(it->second); }
+        s.files[entry->path] = entry;
+        link_front(s, entry);
+        entry->cached = true;
+        s.size += size;
+        cache.size.fetch_add(size);
+        cache.count.fetch_add(1);
+        s.lock.unlock();
+        trim(cache);
+        return true;
+    }
+
+    // 不持有任何锁时调用：超过字节数或缓存项个数的限额时，轮流从各分片的LRU表尾淘汰
+    void trim(lru_cache& cache){
+        int empty = 0; // 连续遇到的空分片数，所有分片都空了就停止
+        while(empty < SHARDS && over_limit(cache)){
+            shard& s = cache.shards[cache.next_victim.fetch_add(1, std::memory_order_relaxed) % SHARDS];
+            s.lock.lock();
+            if(s.tail){
+                detach(s.tail);
+                empty = 0;
+            }
+            else{ ++empty; }
+            s.lock.unlock();
+        }
+    }
+
+    static bool over_limit(const lru_cache& cache){
+        size_t max_entries = cache.max_entries.load(std::memory_order_relaxed);
+        return cache.size.load(std::memory_order_relaxed) > cache.capacity.load(std::memory_order_relaxed)
+            || (max_entries && cache.count.load(std::memory_order_relaxed) > max_entries);
+    }
+
+    // 在缓存项所在分片的锁内调用：把它从哈希表和LRU链表中摘除，没有使用者时立即释放映射
+    void detach(file_entry* entry){
+        lru_cache& cache = cache_of(entry);
+        shard& s = cache.shards[entry->shard];
+        s.files.erase(entry->path);
+        unlink(s, entry);
+        entry->cached = false;
+        s.size -= entry->st.st_size;
+        cache.size.fetch_sub(entry->st.st_size);
+        cache.count.fetch_sub(1);
+        if(entry->refcnt == 0){ destroy(entry); }
+    }
+
+    static void link_front(shard& s, file_entry* entry){
+        entry->prev = NULL;
+        entry->next = s.head;
+        if(s.head){ s.head->prev = entry; }
+        s.head = entry;
+        if(!s.tail){ s.tail = entry; }
+    }
+
+    static void unlink(shard& s, file_entry* entry){
+        if(entry->prev){ entry->prev->next = entry->next; }
+        else if(s.head == entry){ s.head = entry->next; }
+        if(entry->next){ entry->next->prev = entry->prev; }
+        else if(s.tail == entry){ s.tail = entry->prev; }
+        entry->prev = entry->next = NULL;
+    }
+
+    static void destroy(file_entry* entry){
+        if(entry->compressed){ free(entry->addr); }
+        else if(entry->addr){ munmap(entry->addr, entry->st.st_size); }
+        if(entry->fd >= 0){ close(entry->fd); }
+        delete entry;
+    }
+
+    private:
+    lru_cache m_mapped;      // 文件的映射（或sendfile模式下打开的文件描述符）
+    lru_cache m_gzip;        // 文件的gzip压缩版本
+    int m_revalidate;        // 两次stat校验之间的最小间隔（秒）
+    bool m_sendfile;         // 缓存文件描述符还是映射
+};
+
+#endif
@@ -0,0 +1,170 @@
+// 请求头部表
+// parse_headers不再用一串strncasecmp逐个比较头部字段名，而是把每个头部记为读缓冲区中的一段名字和一段值，
+// 常见的字段名通过编译期生成的完美哈希直接得到编号，之后按编号以O(1)取值，不认识的头部也保留下来供处理者按名字查找
+// 表中记录的是相对读缓冲区开头的偏移，读缓冲区扩大或换位置之后仍然有效
+#ifndef HEADER_TABLE_H
+#define HEADER_TABLE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <string_view>
+
+// 有编号的头部字段，HEADER_OTHER表示不在其中
+enum HEADER_ID
+{
+    HEADER_CONNECTION = 0,
+    HEADER_CONTENT_LENGTH,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_EXPECT,
+    HEADER_HOST,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MATCH,
+    HEADER_IF_UNMODIFIED_SINCE,
+    HEADER_IF_RANGE,
+    HEADER_RANGE,
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_CONTENT_TYPE,
+    HEADER_USER_AGENT,
+    HEADER_REFERER,
+    HEADER_ORIGIN,
+    HEADER_COOKIE,
+    HEADER_AUTHORIZATION,
+    HEADER_CACHE_CONTROL,
+    HEADER_PRAGMA,
+    HEADER_UPGRADE,
+    HEADER_X_FORWARDED_FOR,
+    HEADER_COUNT,
+    HEADER_OTHER = HEADER_COUNT
+};
+
+namespace header_hash{
+
+// 与HEADER_ID的顺序一致
+inline constexpr std::string_view names[HEADER_COUNT] = {
+    "Connection", "Content-Length", "Transfer-Encoding", "Expect", "Host", "If-Modified-Since", "If-None-Match",
+    "If-Match", "If-Unmodified-Since", "If-Range", "Range", "Accept", "Accept-Encoding", "Accept-Language",
+    "Content-Type", "User-Agent", "Referer", "Origin", "Cookie", "Authorization", "Cache-Control", "Pragma",
+    "Upgrade", "X-Forwarded-For"
+};
+
+inline constexpr int SLOT_BITS = 6;
+inline constexpr int SLOTS = 1 << SLOT_BITS;
+
+// 忽略大小写的FNV-1a，取高SLOT_BITS位作为槽位
+// 字段名都是token字符，或上0x20就能把大写字母变成小写，其它token字符不受影响或只会多一些哈希冲突，最终仍以strncasecmp为准
+constexpr unsigned slot_of(const char* name, size_t len, uint32_t seed){
+    uint32_t h = seed;
+    for(size_t i = 0; i < len; ++i){ h = (h ^ (unsigned char)(name[i] | 0x20)) * 16777619u; }
+    return h >> (32 - SLOT_BITS);
+}
+
+// 编译时从FNV的初始值开始找一个让所有字段名落在不同槽位上的种子
+constexpr uint32_t find_seed(){
+    for(uint32_t seed = 2166136261u; ; ++seed){
+        bool used[SLOTS] = {};
+        bool ok = true;
+        for(int id = 0; id < HEADER_COUNT && ok; ++id){
+            unsigned slot = slot_of(names[id].data(), names[id].size(), seed);
+            ok = !used[slot];
+            used[slot] = true;
+        }
+        if(ok){ return seed; }
+    }
+}
+
+inline constexpr uint32_t SEED = find_seed();
+
+struct slot_table{ signed char ids[SLOTS]; };
+
+constexpr slot_table build_slots(){
+    slot_table table = {};
+    for(int i = 0; i < SLOTS; ++i){ table.ids[i] = -1; }
+    for(int id = 0; id < HEADER_COUNT; ++id){ table.ids[slot_of(names[id].data(), names[id].size(), SEED)] = id; }
+    return table;
+}
+
+inline constexpr slot_table slots = build_slots();
+
+}
+
+class header_table{
+    public:
+    static const int MAX_HEADERS = 64; // 一个请求最多的头部数，超过时回复400
+
+    // 字段名对应的编号，一次哈希加一次比较
+    static HEADER_ID id_of(const char* name, size_t len){
+        int id = header_hash::slots.ids[header_hash::slot_of(name, len, header_hash::SEED)];
+        if(id < 0 || header_hash::names[id].size() != len || strncasecmp(header_hash::names[id].data(), name, len) != 0){
+            return HEADER_OTHER;
+        }
+        return (HEADER_ID)id;
+    }
+
+    // 表中的偏移都相对于*buf，即http_conn的读缓冲区
+    void attach(char* const* buf){ m_buf = buf; }
+
+    void clear(){
+        m_count = 0;
+        memset(m_index, '\0', sizeof(m_index));
+    }
+
+    // 记录一个编号为id的头部，name和value都在读缓冲区中，value之后必须是'\0'
+    // 同名的头部只有第一个能按编号取到，其余的仍可通过name(i)和value(i)遍历
+    // 表满时返回false
+    bool add(HEADER_ID id, const char* name, size_t name_len, const char* value, size_t value_len){
+        if(m_count >= MAX_HEADERS){ return false; }
+        entry& e = m_entries[m_count++];
+        e.name = name - *m_buf;
+        e.name_len = name_len;
+        e.value = value - *m_buf;
+        e.value_len = value_len;
+        if(id != HEADER_OTHER && m_index[id] == 0){ m_index[id] = m_count; }
+        return true;
+    }
+
+    bool has(HEADER_ID id) const { return m_index[id] != 0; }
+
+    // 按编号取头部的值，没有这个头部时返回空的string_view，其data()为NULL
+    std::string_view get(HEADER_ID id) const {
+        if(m_index[id] == 0){ return std::string_view(); }
+        return value(m_index[id] - 1);
+    }
+
+    // 同get，值以'\0'结尾，可以直接当作C字符串使用
+    const char* c_str(HEADER_ID id) const { return get(id).data(); }
+
+    // 按名字查找任意头部，不认识的字段名要遍历整个表
+    std::string_view find(std::string_view name) const {
+        HEADER_ID id = id_of(name.data(), name.size());
+        if(id != HEADER_OTHER){ return get(id); }
+        for(int i = 0; i < m_count; ++i){
+            const entry& e = m_entries[i];
+            if(e.name_len == name.size() && strncasecmp(*m_buf + e.name, name.data(), name.size()) == 0){ return value(i); }
+        }
+        return std::string_view();
+    }
+
+    int size() const { return m_count; }
+    std::string_view name(int i) const { return std::string_view(*m_buf + m_entries[i].name, m_entries[i].name_len); }
+    std::string_view value(int i) const { return std::string_view(*m_buf + m_entries[i].value, m_entries[i].value_len); }
+
+    private:
+    // 读缓冲区不超过64KB，偏移和长度都用16位
+    struct entry{
+        uint16_t name;
+        uint16_t name_len;
+        uint16_t value;
+        uint16_t value_len;
+    };
+
+    char* const* m_buf;
+    int m_count;
+    uint8_t m_index[HEADER_COUNT]; // 各编号第一次出现的位置加1，0表示没有
+    entry m_entries[MAX_HEADERS];
+};
+
+#endif
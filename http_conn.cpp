@@ -1,17 +1,171 @@
 #include "http_conn.h"
 
 const char* ok_200_title = "OK";
+const char* no_content_204_title = "No Content";
+const char* partial_206_title = "Partial Content";
+const char* not_modified_304_title = "Not Modified";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
 const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
+const char* error_405_title = "Method Not Allowed";
+const char* error_405_form = "The requested method is not supported for this resource.\n";
+const char* error_416_title = "Range Not Satisfiable";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
 
+const char* ok_200_empty_form = "<html><body></body></html>";
+
 const char* doc_root = "/var/www/html";
 
+// 预先生成的不变的应答片段
+// 错误应答和空文件的应答整个都是固定的，按是否保持连接各生成一份；文件应答中只有Content-Length随文件变化，
+// 它前面的状态行和后面的Connection头部也是固定的
+// 这些片段在第一次使用时生成，之后直接由iovec引用，不再用vsnprintf格式化，也不再复制到写缓冲区
+struct response_fragment{
+    const char* data;
+    size_t len;
+};
+
+class response_table{
+    public:
+    static const response_table& instance(){
+        static response_table table;
+        return table;
+    }
+
+    // code对应的完整应答，不是固定应答时data为NULL
+    const response_fragment& full(http_conn::HTTP_CODE code, bool linger) const { return m_full[code][linger]; }
+    // HEAD请求的应答：与full相同但不含消息体
+    const response_fragment& head(http_conn::HTTP_CODE code, bool linger) const { return m_head[code][linger]; }
+    // 文件应答的状态行和"Content-Length: "
+    const response_fragment& ok_prefix() const { return m_ok_prefix; }
+    // 206应答的状态行和"Content-Length: "
+    const response_fragment& partial_prefix() const { return m_partial_prefix; }
+    // 动态内容应答的状态行、"Transfer-Encoding: chunked"和"Content-Type: "
+    const response_fragment& chunked_prefix() const { return m_chunked_prefix; }
+    // 304应答的状态行
+    const response_fragment& not_modified() const { return m_not_modified; }
+    // 416应答的状态行、"Content-Length: 0"和"Content-Range: bytes */"
+    const response_fragment& range_not_satisfiable() const { return m_range_not_satisfiable; }
+    // multipart/byteranges的分隔串
+    const response_fragment& boundary() const { return m_boundary; }
+    // Connection头部和结束头部的空行
+    const response_fragment& connection(bool linger) const { return m_connection[linger]; }
+
+    private:
+    response_table(): m_used(0){
+        memset(m_full, '\0', sizeof(m_full));
+        memset(m_head, '\0', sizeof(m_head));
+        for(int linger = 0; linger < 2; ++linger){
+            add_full(http_conn::BAD_REQUEST, 400, error_400_title, error_400_form, linger);
+            add_full(http_conn::NO_RESOURCE, 404, error_404_title, error_404_form, linger);
+            add_full(http_conn::FORBIDDEN_REQUEST, 403, error_403_title, error_403_form, linger);
+            add_full(http_conn::INTERNAL_ERROR, 500, error_500_title, error_500_form, linger);
+            add_full(http_conn::FILE_REQUEST, 200, ok_200_title, ok_200_empty_form, linger);
+            add_full(http_conn::METHOD_NOT_ALLOWED, 405, error_405_title, error_405_form, linger, "Allow: GET, HEAD\r\n");
+            // 204应答不能有消息体，也不带Content-Length
+            m_full[http_conn::NO_CONTENT][linger] = append("HTTP/1.1 204 %s\r\nConnection: %s\r\n\r\n", no_content_204_title,
+                linger ? "keep-alive" : "close");
+            m_head[http_conn::NO_CONTENT][linger] = m_full[http_conn::NO_CONTENT][linger];
+            m_connection[linger] = append("Connection: %s\r\n\r\n", linger ? "keep-alive" : "close");
+        }
+        m_ok_prefix = append("HTTP/1.1 200 %s\r\nContent-Length: ", ok_200_title);
+        m_chunked_prefix = append("HTTP/1.1 200 %s\r\nTransfer-Encoding: chunked\r\nContent-Type: ", ok_200_title);
+        m_not_modified = append("HTTP/1.1 304 %s\r\n", not_modified_304_title);
+        m_partial_prefix = append("HTTP/1.1 206 %s\r\nContent-Length: ", partial_206_title);
+        m_range_not_satisfiable = append("HTTP/1.1 416 %s\r\nContent-Length: 0\r\nContent-Range: bytes */",
+            error_416_title);
+        // 分隔串不能出现在文件内容中，用启动时间和进程号生成，碰巧撞上的可能性可以忽略
+        m_boundary = append("%016llx%08x", (unsigned long long)time(NULL) * 2654435761ULL, (unsigned)getpid());
+    }
+
+    void add_full(http_conn::HTTP_CODE code, int status, const char* title, const char* form, int linger,
+        const char* headers = ""){
+        m_full[code][linger] = append("HTTP/1.1 %d %s\r\nContent-Length: %d\r\n%sConnection: %s\r\n\r\n%s",
+            status, title, (int)strlen(form), headers, linger ? "keep-alive" : "close", form);
+        // 头部就是完整应答去掉末尾的消息体，两者共用同一份数据
+        m_head[code][linger] = m_full[code][linger];
+        m_head[code][linger].len -= strlen(form);
+    }
+
+    response_fragment append(const char* format, ...){
+        va_list arg_list;
+        va_start(arg_list, format);
+        int len = vsnprintf(m_storage + m_used, sizeof(m_storage) - m_used, format, arg_list);
+        va_end(arg_list);
+        assert(len >= 0 && m_used + len < (int)sizeof(m_storage));
+        response_fragment fragment = { m_storage + m_used, (size_t)len };
+        m_used += len + 1;
+        return fragment;
+    }
+
+    private:
+    char m_storage[4096];
+    int m_used;
+    response_fragment m_full[http_conn::CLOSED_CONNECTION + 1][2];
+    response_fragment m_head[http_conn::CLOSED_CONNECTION + 1][2];
+    response_fragment m_ok_prefix;
+    response_fragment m_chunked_prefix;
+    response_fragment m_not_modified;
+    response_fragment m_partial_prefix;
+    response_fragment m_range_not_satisfiable;
+    response_fragment m_boundary;
+    response_fragment m_connection[2];
+};
+
+// 把非负整数写成十进制，每次查表转换两位，返回写入的字节数
+static int format_uint(char* buf, unsigned long long value){
+    static const char digits[] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char tmp[20];
+    int pos = sizeof(tmp);
+    while(value >= 100){
+        int i = (value % 100) * 2;
+        value /= 100;
+        tmp[--pos] = digits[i + 1];
+        tmp[--pos] = digits[i];
+    }
+    if(value >= 10){
+        int i = value * 2;
+        tmp[--pos] = digits[i + 1];
+        tmp[--pos] = digits[i];
+    }
+    else{ tmp[--pos] = '0' + value; }
+    memcpy(buf, tmp + pos, sizeof(tmp) - pos);
+    return sizeof(tmp) - pos;
+}
+
+// 与http_conn::HTTP_CODE的顺序一致
+static const char* code_names[] = { "NO_REQUEST", "GET_REQUEST", "BAD_REQUEST", "NO_RESOURCE", "FORBIDDEN_REQUEST",
+    "FILE_REQUEST", "DYNAMIC_REQUEST", "NOT_MODIFIED", "RANGE_NOT_SATISFIABLE", "NO_CONTENT", "METHOD_NOT_ALLOWED",
+    "INTERNAL_ERROR", "CLOSED_CONNECTION" };
+
+// 与http_conn::METHOD的顺序一致
+static const char* method_names[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH" };
+
+// 处理结果对应的状态码，partial表示文件应答是否按Range回复
+static int status_of(http_conn::HTTP_CODE code, bool partial){
+    switch(code){
+        case http_conn::FILE_REQUEST:{ return partial ? 206 : 200; }
+        case http_conn::DYNAMIC_REQUEST:{ return 200; }
+        case http_conn::NOT_MODIFIED:{ return 304; }
+        case http_conn::RANGE_NOT_SATISFIABLE:{ return 416; }
+        case http_conn::NO_CONTENT:{ return 204; }
+        case http_conn::BAD_REQUEST:{ return 400; }
+        case http_conn::NO_RESOURCE:{ return 404; }
+        case http_conn::FORBIDDEN_REQUEST:{ return 403; }
+        case http_conn::METHOD_NOT_ALLOWED:{ return 405; }
+        default:{ return 500; }
+    }
+}
+
 int setnonblocking(int fd){
     int old_option = fcntl(fd, F_GETFL);
     int new_option = old_option | O_NONBLOCK;
@@ -44,14 +198,44 @@ void modfd(int epollfd, int fd, int ev){
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
-int http_conn::m_user_count = 0;
+conn_stats http_conn::m_conn_stats;
 int http_conn::m_epollfd = -1;
+const router* http_conn::m_router = 0;
+std::atomic<bool> http_conn::m_draining(false);
+
+void http_conn::set_router(router* routes){
+    if(!routes->compiled()){ routes->compile(); }
+    m_router = routes;
+}
+
+// 没有调用set_router时使用的路由：所有url都由网站根目录下的文件回复
+static const router* build_default_router(){
+    static static_file_handler files(doc_root);
+    static router routes;
+    routes.add("/*", &files);
+    routes.compile();
+    return &routes;
+}
+
+static const router& routes(){
+    if(http_conn::m_router){ return *http_conn::m_router; }
+    static const router* default_routes = build_default_router(); // 局部静态变量的初始化是线程安全的
+    return *default_routes;
+}
 
 void http_conn::close_conn(bool real_close){
     if(real_close && (m_sockfd != -1)){
+        unmap(); // 发送到一半就关闭连接时，也要把映射归还给缓存
+        log_responses();
+        free_buffers();
+        delete m_body_handler; // 消息体没有收完就断开了
+        m_body_handler = 0;
+        delete m_producer; // 动态内容没有发完就断开了
+        m_producer = 0;
         removefd(m_epollfd, m_sockfd);
         m_sockfd = -1;
-        m_user_count--;
+        m_conn_stats.current.fetch_sub(1, std::memory_order_relaxed);
+        m_conn_stats.closed.fetch_add(1, std::memory_order_relaxed);
     }
 }
 
@@ -64,12 +248,47 @@ void http_conn::init(int sockfd, const sockaddr_in& addr){
     setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     
     addfd(m_epollfd, sockfd, true);
-    m_user_count++;
+    m_conn_stats.current.fetch_add(1, std::memory_order_relaxed);
+    m_conn_stats.accepted.fetch_add(1, std::memory_order_relaxed);
+
+    m_file_entry = 0;
+    m_file_address = 0;
+    m_batch_file_count = 0;
+    m_read_buf = 0;
+    m_read_buf_size = 0;
+    m_write_buf = 0;
+    m_write_buf_size = 0;
+    m_batch = 0;
+    m_batch_size = 0;
+    m_request = 0;
+    m_request_size = 0;
+    m_body_handler = 0;
+    m_producer = 0;
+    m_record_count = 0;
+    m_first_byte_idx = 0;
+    m_parse_time = 0;
+    m_log_buf = 0;
+    m_log_buf_size = 0;
+    m_log_idx = 0;
+    m_read_time = metrics::now_us();
+    m_request_start = m_read_time;
+    m_idle = true;
 
     init();
 }
 
 void http_conn::init(){
+    reset_request();
+    reset_write();
+    m_keep_alive = false;
+    m_start_line = 0;
+    m_checked_idx = 0;
+    m_read_idx = 0;
+    free_buffers(); // 连接刚建立或刚处理完一批请求时处于空闲状态，缓冲区还给buffer_pool
+}
+
+// 重置解析一个请求所用的状态，读缓冲区中尚未解析的数据保持不动
+void http_conn::reset_request(){
     m_check_state = CHECK_STATE_REQUESTLINE;
     m_linger = false;
 
@@ -77,24 +296,151 @@ void http_conn::init(){
     m_url = 0;
     m_version = 0;
     m_content_length = 0;
-    m_host = 0;
-    m_start_line = 0;
-    m_checked_idx = 0;
-    m_read_idx = 0;
+    m_chunked = false;
+    m_expect_continue = false;
+    m_chunk_state = CHUNK_SIZE;
+    m_body_remaining = 0;
+    delete m_body_handler; // 请求中途出错或连接关闭时，没有收完的消息体作废
+    m_body_handler = 0;
+    if(m_request){
+        m_request->headers.clear();
+        m_request->real_file[0] = '\0';
+    }
+    m_range_count = 0;
+    m_accept_gzip = false;
+    m_gzip = false;
+    m_vary = false;
+    m_file_address = 0;
+}
+
+// 重置一批应答的发送状态，归还这批应答引用的文件和写缓冲区
+void http_conn::reset_write(){
+    log_responses();
+    unmap();
+    buffer_pool::instance()->free(m_write_buf, m_write_buf_size);
+    m_write_buf = 0;
+    m_write_buf_size = 0;
+    buffer_pool::instance()->free((char*)m_batch, m_batch_size);
+    m_batch = 0;
+    m_batch_size = 0;
     m_write_idx = 0;
-    memset(m_read_buf, '\0', READ_BUFFER_SIZE);
-    memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
-    memset(m_real_file, '\0', FILENAME_LEN);
+    m_bytes_to_send = 0;
+    m_bytes_have_send = 0;
+    m_iv_idx = 0;
+    m_iv_count = 0;
+    m_responses = 0;
+    m_sendfile_entry = 0;
+    m_segment_count = 0;
+    m_segment_idx = 0;
+    delete m_producer;
+    m_producer = 0;
+}
+
+// 当前请求的应答已经加入本批，把这个请求从读缓冲区中移走
+// 后面已经读入的数据（流水线中的下一个请求）挪到缓冲区开头，接着从头解析
+// 消息体在解析时已经被移走，剩下的只是请求行和头部
+void http_conn::finish_request(){
+    int consumed = m_checked_idx;
+    if(consumed > m_read_idx){ consumed = m_read_idx; }
+
+    m_read_idx -= consumed;
+    if(m_read_idx > 0){
+        memmove(m_read_buf, m_read_buf + consumed, m_read_idx);
+        m_request_start = m_read_time; // 流水线中的下一个请求最晚在上一次读入时就到达了
+    }
+    m_checked_idx = 0;
+    m_start_line = 0;
+    reset_request();
+}
+
+void http_conn::free_buffers(){
+    buffer_pool::instance()->free(m_read_buf, m_read_buf_size);
+    m_read_buf = 0;
+    m_read_buf_size = 0;
+    buffer_pool::instance()->free((char*)m_request, m_request_size);
+    m_request = 0;
+    m_request_size = 0;
+    buffer_pool::instance()->free(m_write_buf, m_write_buf_size);
+    m_write_buf = 0;
+    m_write_buf_size = 0;
+    buffer_pool::instance()->free((char*)m_batch, m_batch_size);
+    m_batch = 0;
+    m_batch_size = 0;
+}
+
+// 第一次调用时从buffer_pool取得初始大小的读缓冲区和request_state，之后每次扩大一倍，直到MAX_READ_BUFFER_SIZE
+// 解析时只依赖m_read_idx等下标，不要求缓冲区中数据之后的部分是'\0'，所以新缓冲区不需要清零
+bool http_conn::grow_read_buf(){
+    if(!m_read_buf){
+        m_read_buf = buffer_pool::instance()->alloc(READ_BUFFER_SIZE, &m_read_buf_size);
+        if(!m_read_buf){ return false; }
+        m_request = (request_state*)buffer_pool::instance()->alloc(sizeof(request_state), &m_request_size);
+        if(!m_request){
+            buffer_pool::instance()->free(m_read_buf, m_read_buf_size);
+            m_read_buf = 0;
+            m_read_buf_size = 0;
+            return false;
+        }
+        m_request->headers.attach(&m_read_buf);
+        m_request->headers.clear();
+        return true;
+    }
+    if(m_read_buf_size >= MAX_READ_BUFFER_SIZE){ return false; }
+
+    // 已经解析出来的m_url和m_version指向旧缓冲区，换缓冲区之后要平移到新缓冲区中的相同位置
+    // 请求头部表中记录的是偏移，不需要平移
+    char** fields[] = { &m_url, &m_version };
+    const int field_number = sizeof(fields) / sizeof(fields[0]);
+    int offsets[field_number];
+    for(int i = 0; i < field_number; ++i){ offsets[i] = *fields[i] ? *fields[i] - m_read_buf : -1; }
+
+    int old_size = m_read_buf_size;
+    char* buf = buffer_pool::instance()->grow(m_read_buf, &m_read_buf_size, m_read_idx, old_size * 2);
+    if(!buf){ return false; }
+    m_read_buf = buf;
+
+    for(int i = 0; i < field_number; ++i){ *fields[i] = (offsets[i] >= 0) ? m_read_buf + offsets[i] : 0; }
+    return true;
+}
+
+// 同grow_read_buf，写缓冲区在填充应答时按需获取和扩大
+bool http_conn::grow_write_buf(){
+    if(!m_write_buf){
+        m_write_buf = buffer_pool::instance()->alloc(WRITE_BUFFER_SIZE, &m_write_buf_size);
+        return m_write_buf != 0;
+    }
+    if(m_write_buf_size >= MAX_WRITE_BUFFER_SIZE){ return false; }
+
+    int old_size = m_write_buf_size;
+    char* old_buf = m_write_buf;
+    char* buf = buffer_pool::instance()->grow(m_write_buf, &m_write_buf_size, m_write_idx, old_size * 2);
+    if(!buf){ return false; }
+    m_write_buf = buf;
+
+    // 本批中已经填好的应答头部还指向旧缓冲区，要平移过来
+    for(int i = 0; i < m_iv_count; ++i){
+        char* base = (char*)m_batch->iv[i].iov_base;
+        if(base >= old_buf && base < old_buf + old_size){ m_batch->iv[i].iov_base = buf + (base - old_buf); }
+    }
+    return true;
+}
+
+// 一批中的第一个应答开始填充时取得batch_state，不需要清零，各计数在reset_write中已经归零
+bool http_conn::alloc_batch(){
+    if(m_batch){ return true; }
+    m_batch = (batch_state*)buffer_pool::instance()->alloc(sizeof(batch_state), &m_batch_size);
+    return m_batch != 0;
 }
 
 // 从状态机，用于解析出某行的内容
+// 普通字符不再逐个判断，而是由line_scanner按16/32字节一块跳过，直接停在下一个'\r'、'\n'或非法的控制字符上
 http_conn::LINE_STATUS http_conn::parse_line(){
     // m_checked_index指向buffer（应用程序的读缓冲区）中当前正在分析的字节
     // m_read_index指向buffer中客户数据尾部的下一字节（即buffer中数据长度）
-    char temp; // 存放当前分析字节的内容，临时变量
-    for(; m_checked_idx < m_read_idx; ++m_checked_idx){
-        // 我们一个字节一个字节的分析其中的内容
-        temp = m_read_buf[m_checked_idx];
+    while(m_checked_idx < m_read_idx){
+        m_checked_idx += line_scanner::find_stop(m_read_buf + m_checked_idx, m_read_idx - m_checked_idx);
+        if(m_checked_idx >= m_read_idx){ break; }
+        char temp = m_read_buf[m_checked_idx];
 
         // 如果当前字符是'\r'回车符，则说明可能读取到一个完整的行
         if(temp == '\r'){
@@ -107,10 +453,12 @@ http_conn::LINE_STATUS http_conn::parse_line(){
                 m_read_buf[m_checked_idx++] = '\0'; // '\n'替换成'\0'
                 return LINE_OK; // 读取成功
             }
+            // 单独出现的'\r'是语法错误
+            return LINE_BAD;
         }
         // 如果当前字符是'\n'换行符，则也说明可能读取到一个完整的行
         else if(temp == '\n'){
-            if((m_checked_idx > 1) && (m_read_buf[m_checked_idx-1] == 'r')){
+            if((m_checked_idx > 1) && (m_read_buf[m_checked_idx-1] == '\r')){
                 m_read_buf[m_checked_idx - 1] = '\0';
                 m_read_buf[m_checked_idx++] = '\0';
                 return LINE_OK;
@@ -118,17 +466,28 @@ http_conn::LINE_STATUS http_conn::parse_line(){
             // 出现语法错误，直接返回错误
             return LINE_BAD;
         }
+        // 请求行和头部中不能出现其它控制字符
+        return LINE_BAD;
     }
     // 如果所有字节分析完毕也没遇到'\r'或者'\n'，则返回LINE_OPEN，表示还需要继续读取客户数据才能进一步分析
     return LINE_OPEN;
 }
 
 // 循环读取数据，直到无数据可读或者对方关闭连接
+// 读缓冲区满了就扩大，扩大到上限后先停止读取，把已经读入的数据交给工作线程：
+// 流水线中完整的请求被处理后移出缓冲区，消息体边读边处理，工作线程重新注册EPOLLIN后再接着读
+// 只有一个请求的请求行和头部就超过MAX_READ_BUFFER_SIZE时，process才回复400并关闭连接
 bool http_conn::read(){
-    if(m_read_idx >= READ_BUFFER_SIZE){ return false; }
+    m_idle = false;
     int bytes_read = 0;
+    bool idle = m_read_idx == 0 && m_check_state == CHECK_STATE_REQUESTLINE;
     while(true){
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+        if((!m_read_buf || m_read_idx >= m_read_buf_size) && !grow_read_buf()){
+            if(!m_read_buf){ return false; }
+            if(m_check_state == CHECK_STATE_CONTENT && m_read_idx <= m_checked_idx){ return false; }
+            break;
+        }
+        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, m_read_buf_size - m_read_idx, 0);
         if(bytes_read == -1){
             if(errno == EAGAIN || errno == EWOULDBLOCK){ break; }
             return false;
@@ -136,6 +495,9 @@ bool http_conn::read(){
         else if(bytes_read == 0){ return false; }
         m_read_idx += bytes_read;
     }
+    // 空闲连接上新请求的耗时从这里算起
+    m_read_time = metrics::now_us();
+    if(idle && m_read_idx > 0){ m_request_start = m_read_time; }
     return true;
 }
 
@@ -147,6 +509,8 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text){
 
     char* method = text;
     if(strcasecmp(method, "GET") == 0){ m_method = GET; }
+    else if(strcasecmp(method, "HEAD") == 0){ m_method = HEAD; }
+    else if(strcasecmp(method, "POST") == 0){ m_method = POST; }
     else{ return BAD_REQUEST; }
 
     m_url += strspn(m_url, " \t");
@@ -165,53 +529,204 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text){
     return NO_REQUEST;
 }
 
+// Accept-Encoding中是否有q值不为0的gzip或*
+static bool accepts_gzip(const char* text){
+    while(*text){
+        text += strspn(text, " \t,");
+        size_t len = strcspn(text, " \t;,");
+        bool gzip = (len == 4 && strncasecmp(text, "gzip", 4) == 0) || (len == 1 && text[0] == '*');
+        text += len;
+        // 参数中只关心q值，q=0表示不接受
+        bool refused = false;
+        while(*text == ' ' || *text == '\t' || *text == ';'){
+            text += strspn(text, " \t;");
+            if((text[0] == 'q' || text[0] == 'Q') && text[1] == '='){
+                refused = (strtod(text + 2, 0) == 0);
+            }
+            text += strcspn(text, ";,");
+        }
+        if(gzip && !refused){ return true; }
+    }
+    return false;
+}
+
 // 解析HTTP请求的一个头部信息
 http_conn::HTTP_CODE http_conn::parse_headers(char* text){
     // 遇到空行，表示头部字段解析完毕
     if(text[0] == '\0'){
-        // 如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体
-        // 状态机转移到CHECK_STATE_CONTENT状态
-        if(m_content_length != 0){
-            m_check_state = CHECK_STATE_CONTENT;
-            return NO_REQUEST;
-        }
+        // 如果HTTP请求有消息体，则还需要读取m_content_length字节（或分块编码）的消息体
+        // 状态机转移到CHECK_STATE_CONTENT状态，POST请求即使消息体为空也要交给body_handler
+        if(m_content_length != 0 || m_chunked || m_method == POST){ return begin_body(); }
         // 头部字段解析完毕就可以去do_request操作然后将其返回给客户
         return GET_REQUEST;
     }
-    // 处理Connection头部字段
-    else if(strncasecmp(text, "Connection:", 11) == 0){
-        text += 11;
-        text += strspn(text, " \t");
-        if(strcasecmp(text, "keep-alive") == 0){ m_linger = true; }
-    }
-    // 处理Content-Length头部字段
-    else if(strncasecmp(text, "Content-Length:", 15) == 0){
-        text += 15;
-        text += strspn(text, " \t");
-        m_content_length = atol(text);
-    }
-    // 处理头部字段
-    else if(strncasecmp(text, "Host:", 5) == 0){
-        text += 5;
-        text += strspn(text, " \t");
-        m_host = text;
-    }
-    else{
-        printf("oop! unknow header %s\n", text);
+
+    // 头部字段名必须全部由token字符组成并紧跟着':'，text所在的行已经以'\0'结尾，扫描一定会在行内停下
+    size_t name_len = line_scanner::find_non_token(text, m_read_idx - (text - m_read_buf));
+    if(name_len == 0 || text[name_len] != ':'){ return BAD_REQUEST; }
+
+    // 去掉值前后的空白，末尾的空白改成'\0'，使值之后紧跟着'\0'
+    char* value = text + name_len + 1;
+    value += strspn(value, " \t");
+    size_t value_len = strlen(value);
+    while(value_len > 0 && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t')){ value[--value_len] = '\0'; }
+
+    HEADER_ID id = header_table::id_of(text, name_len);
+    // 重复的Content-Length或Transfer-Encoding使消息体的边界不确定，可能被用来夹带请求
+    if((id == HEADER_CONTENT_LENGTH || id == HEADER_TRANSFER_ENCODING) && m_request->headers.has(id)){ return BAD_REQUEST; }
+    if(!m_request->headers.add(id, text, name_len, value, value_len)){ return BAD_REQUEST; }
+
+    // 这里只处理影响解析本身的头部，Host、条件请求和Range等头部在do_request中从头部表取值
+    switch(id){
+        case HEADER_CONNECTION:{
+            if(strcasecmp(value, "keep-alive") == 0){ m_linger = true; }
+            break;
+        }
+        case HEADER_CONTENT_LENGTH:{
+            char* end = 0;
+            m_content_length = strtol(value, &end, 10);
+            if(end == value || *end != '\0' || m_content_length < 0){ return BAD_REQUEST; }
+            break;
+        }
+        // 只支持分块编码，同时出现Content-Length时以分块编码为准
+        case HEADER_TRANSFER_ENCODING:{
+            if(strcasecmp(value, "chunked") != 0){ return BAD_REQUEST; }
+            m_chunked = true;
+            break;
+        }
+        case HEADER_EXPECT:{
+            m_expect_continue = (strcasecmp(value, "100-continue") == 0);
+            break;
+        }
+        case HEADER_ACCEPT_ENCODING:{
+            m_accept_gzip = accepts_gzip(value);
+            break;
+        }
+        default:{ break; }
     }
 
     return NO_REQUEST;
 }
 
-// 我们没有真正解析HTTP请求的消息体，只是判断它是否完整读入
-http_conn::HTTP_CODE http_conn::parse_content(char* text){
-    if(m_read_idx >= (m_content_length + m_checked_idx)){
-        text[m_content_length] = '\0';
-        return GET_REQUEST;
+// 请求头部解析完毕，准备接收消息体
+// POST请求的消息体交给url对应的request_handler创建的body_handler，其它请求的消息体读完后丢弃
+http_conn::HTTP_CODE http_conn::begin_body(){
+    m_check_state = CHECK_STATE_CONTENT;
+    m_chunk_state = CHUNK_SIZE;
+    m_body_remaining = m_chunked ? 0 : m_content_length;
+    route_match match;
+    if(m_method == POST && routes().match(m_url, &match)){
+        match.headers = &m_request->headers;
+        m_body_handler = match.handler->on_post(match, m_chunked ? -1 : m_content_length);
+    }
+
+    // 客户在等我们同意之后才发送消息体；本批还有没发出的应答时不能插到它们前面，客户等不到也会在超时后直接发送
+    if(m_expect_continue && m_responses == 0){
+        static const char continue_100[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        send(m_sockfd, continue_100, sizeof(continue_100) - 1, 0);
     }
     return NO_REQUEST;
 }
 
+// 消息体不再整个放在读缓冲区中：读缓冲区中从m_checked_idx开始的数据都属于消息体，
+// 每次把已经读入的部分交给body_handler，然后从读缓冲区中移走，头部仍然留在原处供do_request使用
+// 返回NO_REQUEST表示消息体还没有收完，GET_REQUEST表示已经收完
+http_conn::HTTP_CODE http_conn::parse_content(){
+    int pos = m_checked_idx;
+    HTTP_CODE ret = decode_body(&pos);
+
+    // 处理完的部分一次性移走，后面可能紧跟着流水线中的下一个请求
+    int consumed = pos - m_checked_idx;
+    if(consumed > 0){
+        memmove(m_read_buf + m_checked_idx, m_read_buf + pos, m_read_idx - pos);
+        m_read_idx -= consumed;
+    }
+    return ret;
+}
+
+// 从*pos开始解析消息体，分块编码时解开分块，*pos前进到处理完的数据之后
+http_conn::HTTP_CODE http_conn::decode_body(int* pos){
+    if(!m_chunked){
+        long len = m_read_idx - *pos;
+        if(len > m_body_remaining){ len = m_body_remaining; }
+        if(!feed_body(pos, len)){ return INTERNAL_ERROR; }
+        return (m_body_remaining == 0) ? GET_REQUEST : NO_REQUEST;
+    }
+
+    while(true){
+        char* data = m_read_buf + *pos;
+        long avail = m_read_idx - *pos;
+        switch(m_chunk_state){
+            // 分块大小行和尾部头部行都是以CRLF结尾的短行
+            case CHUNK_SIZE:
+            case CHUNK_TRAILER:{
+                char* eol = (char*)memchr(data, '\n', avail);
+                if(!eol){ return (avail > MAX_CHUNK_LINE) ? BAD_REQUEST : NO_REQUEST; }
+                if(eol == data || eol[-1] != '\r'){ return BAD_REQUEST; }
+                int line_len = eol + 1 - data;
+                *pos += line_len;
+                if(m_chunk_state == CHUNK_TRAILER){
+                    // 空行表示消息体结束，尾部头部本身被忽略
+                    if(line_len == 2){ return GET_REQUEST; }
+                    break;
+                }
+
+                // 十六进制的分块大小，后面可能跟着以';'开始的扩展
+                long size = 0;
+                int digits = 0;
+                for(char* p = data; p < eol - 1; ++p, ++digits){
+                    int d = 0;
+                    if(*p >= '0' && *p <= '9'){ d = *p - '0'; }
+                    else if(*p >= 'a' && *p <= 'f'){ d = *p - 'a' + 10; }
+                    else if(*p >= 'A' && *p <= 'F'){ d = *p - 'A' + 10; }
+                    else if(*p == ';' || *p == ' ' || *p == '\t'){ break; }
+                    else{ return BAD_REQUEST; }
+                    if(size > (0x7fffffffffffffffL >> 4)){ return BAD_REQUEST; }
+                    size = size * 16 + d;
+                }
+                if(digits == 0){ return BAD_REQUEST; }
+                m_body_remaining = size;
+                m_chunk_state = (size > 0) ? CHUNK_DATA : CHUNK_TRAILER;
+                break;
+            }
+            case CHUNK_DATA:{
+                long len = (avail < m_body_remaining) ? avail : m_body_remaining;
+                if(len == 0){ return NO_REQUEST; }
+                if(!feed_body(pos, len)){ return INTERNAL_ERROR; }
+                if(m_body_remaining == 0){ m_chunk_state = CHUNK_DATA_END; }
+                break;
+            }
+            case CHUNK_DATA_END:{
+                if(avail < 2){ return NO_REQUEST; }
+                if(data[0] != '\r' || data[1] != '\n'){ return BAD_REQUEST; }
+                *pos += 2;
+                m_chunk_state = CHUNK_SIZE;
+                break;
+            }
+        }
+    }
+}
+
+// 把读缓冲区中从*pos开始的len字节消息体交给body_handler，没有body_handler时直接丢弃
+bool http_conn::feed_body(int* pos, long len){
+    if(len <= 0){ return true; }
+    if(m_body_handler && !m_body_handler->on_data(m_read_buf + *pos, len)){ return false; }
+    *pos += len;
+    m_body_remaining -= len;
+    return true;
+}
+
+// 消息体已经全部收到
+// POST请求的结果由body_handler决定；其它请求的消息体已被丢弃，照常回复目标文件
+http_conn::HTTP_CODE http_conn::end_body(){
+    if(m_method != POST){ return do_request(); }
+    if(!m_body_handler){ return METHOD_NOT_ALLOWED; }
+    bool ok = m_body_handler->on_end();
+    delete m_body_handler;
+    m_body_handler = 0;
+    return ok ? NO_CONTENT : INTERNAL_ERROR;
+}
+
 // 主状态机，其分析参考8.6节
 http_conn::HTTP_CODE http_conn::process_read(){
     LINE_STATUS line_status = LINE_OK;
@@ -224,7 +739,7 @@ http_conn::HTTP_CODE http_conn::process_read(){
        || ((line_status = parse_line()) == LINE_OK)){
         text = get_line(); // 因为parse_line()中把'\r'和'\n'替换成了'\0'，所以这里得到的text就是一行内容
         m_start_line = m_checked_idx; // 重置m_start_line的位置，下一次就是下一行的起点了
-        printf("got 1 http line: %s\n", text);
+        LOG_DEBUG("got 1 http line: %s", text);
 
         switch(m_check_state){
             // 请求消息分为3部分：
@@ -248,194 +763,676 @@ http_conn::HTTP_CODE http_conn::process_read(){
                 break;
             }
             case CHECK_STATE_CONTENT:{
-                ret = parse_content(text);
-                if(ret == GET_REQUEST){ return do_request(); }
+                ret = parse_content();
+                if(ret == GET_REQUEST){ return end_body(); }
+                if(ret != NO_REQUEST){ return ret; }
                 line_status = LINE_OPEN;
                 break;
             }
             default:{ return INTERNAL_ERROR; }
         }
     }
+    // 行中出现了非法字符，不必再等更多数据
+    if(line_status == LINE_BAD){ return BAD_REQUEST; }
     // 只要没出现解析异常就可以申请继续读取数据进一步分析了
     return NO_REQUEST;
 }
 
-// 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性
+// 当得到一个完整、正确的HTTP请求时，先由路由找到url对应的request_handler
+// 它可以生成动态内容，也可以给出目标文件的路径，此时我们就分析目标文件的属性
 // 如果目标文件存在、对所有用户可读，且不是目录
-// 则使用mmap将其映射到内存地址m_file_address处，并告诉调用者获取文件成功
+// 则从file_cache取得它的映射，映射地址放在m_file_address处，并告诉调用者获取文件成功
 http_conn::HTTP_CODE http_conn::do_request(){
-    strcpy(m_real_file, doc_root); // doc_root -> m_real_file
-    int len = strlen(doc_root);
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
-    
-    if(stat(m_real_file, &m_file_stat) < 0){ return NO_RESOURCE; }
-    if(!(m_file_stat.st_mode & S_IROTH)){ return FORBIDDEN_REQUEST; }
-    if(S_ISDIR(m_file_stat.st_mode)){ return BAD_REQUEST; }
+    route_match match;
+    if(!routes().match(m_url, &match)){ return NO_RESOURCE; }
+    match.headers = &m_request->headers;
+    m_producer = match.handler->on_get(match);
+    if(m_producer){ return DYNAMIC_REQUEST; }
+    if(!match.handler->file_path(match, m_request->real_file, FILENAME_LEN)){ return NO_RESOURCE; }
 
-    int fd = open(m_real_file, O_RDONLY);
-    m_file_address = (char*)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
+    // 热点文件直接命中缓存，不再需要stat、open和mmap
+    m_file_entry = file_cache::instance()->acquire(m_request->real_file, &m_file_stat);
+    if(!m_file_entry){
+        if(m_file_stat.st_mode == 0){ return NO_RESOURCE; }
+        if(!(m_file_stat.st_mode & S_IROTH)){ return FORBIDDEN_REQUEST; }
+        if(S_ISDIR(m_file_stat.st_mode)){ return BAD_REQUEST; }
+        if(!S_ISREG(m_file_stat.st_mode)){ return FORBIDDEN_REQUEST; }
+        return INTERNAL_ERROR; // 普通文件却映射失败
+    }
+
+    // 先确定发送原文件还是压缩版本，条件请求要和实际发送的版本比较
+    choose_encoding();
+
+    // 客户缓存的版本仍然有效时只回复304，文件内容不会被发送
+    if(not_modified()){ return NOT_MODIFIED; }
+
+    // 带If-Range时，只有客户手中的版本仍是当前版本才按Range回复，否则回复整个文件
+    const char* if_range = m_request->headers.c_str(HEADER_IF_RANGE);
+    if(m_request->headers.has(HEADER_RANGE) && m_file_stat.st_size > 0){
+        if(!if_range || strcmp(if_range, m_file_entry->etag) == 0 || strcmp(if_range, m_file_entry->last_modified) == 0){
+            m_range_count = parse_ranges();
+            if(m_range_count < 0){
+                m_range_count = 0;
+                return RANGE_NOT_SATISFIABLE;
+            }
+        }
+    }
+
+    m_file_address = m_file_entry->addr;
     return FILE_REQUEST; // 我们只能正确处理这一种情况
 }
 
-// 对内存映射区执行munmap操作
+// 解析Range头部，如"bytes=0-499"、"bytes=500-"、"bytes=-500"或用逗号分隔的多个区间，结果放在ranges中
+// 返回能满足的区间数；返回0表示忽略Range头部（格式不认识或区间太多），回复整个文件；返回-1表示所有区间都在文件之外
+int http_conn::parse_ranges(){
+    const char* p = m_request->headers.c_str(HEADER_RANGE);
+    if(strncasecmp(p, "bytes=", 6) != 0){ return 0; }
+    p += 6;
+
+    off_t size = m_file_stat.st_size;
+    int count = 0;
+    while(true){
+        p += strspn(p, " \t,");
+        if(*p == '\0'){ break; }
+
+        off_t start = 0;
+        off_t end = size;
+        char* stop = 0;
+        if(*p == '-'){
+            // 最后若干字节
+            if(*++p < '0' || *p > '9'){ return 0; }
+            long long suffix = strtoll(p, &stop, 10);
+            if(suffix < size){ start = size - suffix; }
+            if(suffix == 0){ start = size; } // 长度为0的区间无法满足
+        }
+        else if(*p >= '0' && *p <= '9'){
+            start = strtoll(p, &stop, 10);
+            if(*stop != '-'){ return 0; }
+            p = stop + 1;
+            stop = (char*)p;
+            if(*p >= '0' && *p <= '9'){
+                long long last = strtoll(p, &stop, 10);
+                if(last < start){ return 0; }
+                if(last < size){ end = last + 1; }
+            }
+        }
+        else{ return 0; }
+
+        p = stop + strspn(stop, " \t");
+        if(*p != ',' && *p != '\0'){ return 0; }
+        if(start >= size){ continue; }
+        if(count >= MAX_RANGES){ return 0; }
+        m_request->ranges[count].start = start;
+        m_request->ranges[count].end = end;
+        ++count;
+    }
+    return (count > 0) ? count : -1;
+}
+
+// 文本类文件压缩效果好，第一次请求时压缩一次并缓存
+static bool compressible(const char* path){
+    static const char* types[] = { ".html", ".htm", ".css", ".js", ".mjs", ".json", ".xml", ".svg", ".txt", ".csv",
+        ".md", ".map", ".wasm" };
+    const char* ext = strrchr(path, '.');
+    if(!ext || strchr(ext, '/')){ return false; }
+    for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i){
+        if(strcasecmp(ext, types[i]) == 0){ return true; }
+    }
+    return false;
+}
+
+// 客户接受gzip时改用file_cache中文件的压缩版本，以后的Content-Length、ETag和文件内容都来自压缩版本
+// Range请求的区间是针对原文件的，仍然发送原文件
+void http_conn::choose_encoding(){
+    m_vary = compressible(m_request->real_file);
+    if(!m_accept_gzip || m_request->headers.has(HEADER_RANGE) || m_file_stat.st_size == 0){ return; }
+
+    file_entry* gzip = file_cache::instance()->acquire_gzip(m_file_entry, m_vary);
+    if(!gzip){ return; }
+    file_cache::instance()->release(m_file_entry);
+    m_file_entry = gzip;
+    m_file_stat = gzip->st;
+    m_gzip = true;
+    m_vary = true;
+}
+
+// If-None-Match中的实体标签列表是否包含etag，按弱比较忽略"W/"前缀
+static bool etag_match(const char* list, const char* etag){
+    size_t etag_len = strlen(etag);
+    while(*list){
+        list += strspn(list, " \t,");
+        if(*list == '*'){ return true; }
+        if(strncmp(list, "W/", 2) == 0){ list += 2; }
+        size_t len = strcspn(list, " \t,");
+        if(len == etag_len && memcmp(list, etag, len) == 0){ return true; }
+        list += len;
+    }
+    return false;
+}
+
+// 判断条件请求的目标文件是否没有被修改过
+// If-None-Match优先；If-Modified-Since通常就是上次应答中的Last-Modified，先直接比较字符串，不同时才解析日期
+bool http_conn::not_modified() const {
+    const char* if_none_match = m_request->headers.c_str(HEADER_IF_NONE_MATCH);
+    const char* if_modified_since = m_request->headers.c_str(HEADER_IF_MODIFIED_SINCE);
+    if(if_none_match){ return etag_match(if_none_match, m_file_entry->etag); }
+    if(if_modified_since){
+        if(strcmp(if_modified_since, m_file_entry->last_modified) == 0){ return true; }
+        struct tm tm;
+        memset(&tm, '\0', sizeof(tm));
+        const char* end = strptime(if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if(!end || *end != '\0'){ return false; }
+        return m_file_stat.st_mtime <= timegm(&tm);
+    }
+    return false;
+}
+
+// 把当前请求和本批所有应答引用的映射归还给file_cache，是否真正munmap由缓存决定
 void http_conn::unmap(){
-    if(m_file_address){
-        munmap(m_file_address, m_file_stat.st_size);
+    if(m_file_entry){
+        file_cache::instance()->release(m_file_entry);
+        m_file_entry = 0;
         m_file_address = 0;
     }
+    for(int i = 0; i < m_batch_file_count; ++i){
+        file_cache::instance()->release(m_batch->files[i]);
+    }
+    m_batch_file_count = 0;
+    m_sendfile_entry = 0;
+}
+
+// 当前应答已经填好，它引用的文件要保留到整批应答发送完毕
+void http_conn::hold_file(){
+    if(m_file_entry){
+        m_batch->files[m_batch_file_count++] = m_file_entry;
+        m_file_entry = 0;
+    }
 }
 
 // 写HTTP响应
+// 一次write发送一整批（流水线中的若干个）应答，m_bytes_to_send和m_bytes_have_send记录整批的发送进度
+// writev只发出一部分时，跳过已经发完的iovec，并把发了一半的那块的起始位置和长度往后调整
+// 这样下一轮EPOLLOUT从断点继续，既不会重发已发出的数据，也不会因为长度算错而提前结束或空转
+// sendfile模式下本批最后一个应答的文件内容不在iovec里，而是由segments中的若干段组成：
+// 每段之前的数据用带MSG_MORE的sendmsg发出，让内核把它们和随后的文件内容拼成尽量满的报文段，
+// 文件内容则用sendfile直接从页缓存发给socket，其发送进度由各段的offset记录
 bool http_conn::write(){
-    int temp = 0;
-    int bytes_have_send = 0;
-    int bytes_to_send = m_write_idx;
+    if(m_bytes_to_send == 0){ return finish_write(); }
 
+    while(true){
+        // 先发出下一段文件内容之前的iovec，没有文件内容时就是全部iovec
+        bool more = m_segment_idx < m_segment_count;
+        int limit = more ? m_request->segments[m_segment_idx].iv_pos : m_iv_count;
+        while(m_iv_idx < limit){
+            int temp = 0;
+            if(more){
+                struct msghdr msg;
+                memset(&msg, '\0', sizeof(msg));
+                msg.msg_iov = m_batch->iv + m_iv_idx;
+                msg.msg_iovlen = limit - m_iv_idx;
+                temp = sendmsg(m_sockfd, &msg, MSG_MORE);
+            }
+            else{
+                temp = writev(m_sockfd, m_batch->iv + m_iv_idx, limit - m_iv_idx);
+            }
+            if(temp <= -1){
+                // 如果TCP没有写缓存空间，则等待下一轮的EPOLLOUT事件
+                // 虽然在此期间服务器无法立即接收到同一客户的下一请求，但这可以保证连接的完整性
+                if(errno == EAGAIN){
+                    modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                    return true;
+                }
+                // 其它情况就是出错了
+                unmap();
+                return false;
+            }
 
-    if(bytes_to_send == 0){
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        init(); // 重开
-        return true;
-    }
+            m_bytes_to_send -= temp;
+            m_bytes_have_send += temp;
+            first_bytes_sent();
 
-    while(1){
-        temp = writev(m_sockfd, m_iv, m_iv_count);
-        if(temp <= -1){
-            // 如果TCP没有写缓存空间，则等待下一轮的EPOLLOUT事件
-            // 虽然在此期间服务器无法立即接收到同一客户的下一请求，但这可以保证连接的完整性
-            if(errno == EAGAIN){
-                modfd(m_epollfd, m_sockfd, EPOLLOUT);
-                return true;
+            // 跳过已经发完的iovec，调整发了一半的那块
+            size_t sent = temp;
+            while(m_iv_idx < limit && sent >= m_batch->iv[m_iv_idx].iov_len){
+                sent -= m_batch->iv[m_iv_idx].iov_len;
+                ++m_iv_idx;
+            }
+            if(m_iv_idx < limit){
+                m_batch->iv[m_iv_idx].iov_base = (char*)m_batch->iv[m_iv_idx].iov_base + sent;
+                m_batch->iv[m_iv_idx].iov_len -= sent;
             }
-            // 其它情况就是出错了
-            unmap();
-            return false;
+        }
+        if(!more){
+            // iovec中的数据都已发出，接着生成并发送动态内容的下一个分块，内容结束后才算这批发完
+            if(!m_producer){ break; }
+            if(!next_chunk()){
+                unmap();
+                return false;
+            }
+            continue;
         }
 
-        // 这块不太理解
-
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-
-        // 我的理解：下面的代码是指只要temp != 1且bytes_to_send <= bytes_have_send那么数据就是传完了
-        if(bytes_to_send <= bytes_have_send){
-            unmap();
-            if(m_linger){
-                init();
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
-                return true;
+        file_segment& segment = m_request->segments[m_segment_idx];
+        while(segment.offset < segment.end){
+            ssize_t ret = sendfile(m_sockfd, m_sendfile_entry->fd, &segment.offset, segment.end - segment.offset);
+            if(ret < 0){
+                if(errno == EAGAIN){
+                    modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                    return true;
+                }
+                unmap();
+                return false;
             }
-            else{
-                modfd(m_epollfd, m_sockfd, EPOLLIN); // 这句我觉得多余了
+            // 文件在发送过程中被截短了，已经无法发出完整的应答
+            if(ret == 0){
+                unmap();
                 return false;
             }
+            m_bytes_to_send -= ret;
+            m_bytes_have_send += ret;
+            first_bytes_sent();
         }
+        ++m_segment_idx;
     }
+
+    return finish_write();
 }
 
-// 往写缓冲中写入待发送数据
-bool http_conn::add_response(const char* format, ...){
-    if(m_write_idx >= WRITE_BUFFER_SIZE){ return false; }
+// 一批应答全部发送完毕
+bool http_conn::finish_write(){
+    bool keep_alive = m_keep_alive;
+    reset_write();
+    if(!keep_alive){ return false; }
 
-    va_list arg_list;
-    va_start(arg_list, format);
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
-    if(len >= (WRITE_BUFFER_SIZE - 1- m_write_idx)){ return false; }
+    // 读缓冲区里还有流水线中的后续请求，它们已经读入，不会再触发EPOLLIN
+    // 所以这里不重新注册事件，由调用者通过has_buffered_request发现后直接交给线程池
+    if(has_buffered_request()){ return true; }
+    // 服务器正在停止，不再等待下一个请求
+    if(m_draining.load(std::memory_order_relaxed)){ return false; }
 
-    m_write_idx += len;
-    va_end(arg_list);
+    // 连接进入空闲状态，读缓冲区也还给buffer_pool
+    m_idle = true;
+    init();
+    modfd(m_epollfd, m_sockfd, EPOLLIN);
     return true;
 }
 
-bool http_conn::add_status_line(int status, const char* title){
-    add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
+// 保证写缓冲区中至少还有len字节的空间
+bool http_conn::reserve_write(int len){
+    if(!m_write_buf && !grow_write_buf()){ return false; }
+    while(m_write_buf_size - m_write_idx < len){
+        if(!grow_write_buf()){ return false; }
+    }
+    return true;
 }
 
-bool http_conn::add_headers(int content_len){
-    add_content_length(content_len);
-    add_linger();
-    add_blank_line();
+// 把动态的头部内容追加到写缓冲区，不经过vsnprintf
+bool http_conn::append(const char* data, int len){
+    if(!reserve_write(len)){ return false; }
+    memcpy(m_write_buf + m_write_idx, data, len);
+    m_write_idx += len;
+    return true;
 }
 
-bool http_conn::add_content_length(int content_len){
-    return add_response("Content-Length: %d\r\n", content_len);
+bool http_conn::append_uint(unsigned long long value){
+    if(!reserve_write(20)){ return false; }
+    m_write_idx += format_uint(m_write_buf + m_write_idx, value);
+    return true;
 }
 
 bool http_conn::add_linger(){
-    return add_response("Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close");
+    const response_fragment& fragment = response_table::instance().connection(m_linger);
+    return add_iov(fragment.data, fragment.len);
 }
 
-bool http_conn::add_blank_line(){
-    return add_response("%s", "\r\n");
+// 把一块待发送的数据加入本批的iovec
+// 与上一块在写缓冲区中首尾相接时直接合并；固定片段和文件内容不合并，grow_write_buf只需平移指向写缓冲区的iovec
+// sendfile模式下两块之间夹着一段文件内容时也不能合并
+bool http_conn::add_iov(const char* base, size_t len){
+    if(len == 0){ return true; }
+    bool after_segment = m_segment_count > 0 && m_request->segments[m_segment_count - 1].iv_pos == m_iv_count;
+    if(m_iv_count > 0 && !after_segment){
+        struct iovec& last = m_batch->iv[m_iv_count - 1];
+        char* end = (char*)last.iov_base + last.iov_len;
+        if(end == base && base > m_write_buf && base <= m_write_buf + m_write_idx){
+            last.iov_len += len;
+            m_bytes_to_send += len;
+            return true;
+        }
+    }
+    if(m_iv_count >= MAX_IOV){ return false; }
+    m_batch->iv[m_iv_count].iov_base = (void*)base;
+    m_batch->iv[m_iv_count].iov_len = len;
+    ++m_iv_count;
+    m_bytes_to_send += len;
+    return true;
 }
 
-bool http_conn::add_content(const char* content){
-    return add_response("%s", content);
+// ETag、Last-Modified以及和压缩有关的头部，内容来自目标文件的缓存项
+bool http_conn::add_entity_headers(){
+    const char* etag = m_file_entry->etag;
+    const char* last_modified = m_file_entry->last_modified;
+    if(!append("ETag: ", 6) || !append(etag, strlen(etag)) || !append("\r\nLast-Modified: ", 17)
+        || !append(last_modified, strlen(last_modified)) || !append("\r\n", 2)){ return false; }
+    if(m_gzip && !append("Content-Encoding: gzip\r\n", 24)){ return false; }
+    if(m_vary && !append("Vary: Accept-Encoding\r\n", 23)){ return false; }
+    return true;
 }
 
-// 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
-bool http_conn::process_write(HTTP_CODE ret){
-    switch(ret){
-        case INTERNAL_ERROR:{
-            add_status_line(500, error_500_title);
-            add_headers(strlen(error_500_form));
-            if(!add_content(error_500_form)){ return false; }
-            break;
-        }
-        case BAD_REQUEST:{
-            add_status_line(400, error_400_title);
-            add_headers(strlen(error_400_form));
-            if(!add_content(error_400_form)){ return false; }
-            break;
-        }
-        case NO_RESOURCE:{
-            add_status_line(404, error_404_title);
-            add_headers(strlen(error_404_form));
-            if(!add_content(error_404_form)){ return false; }
-            break;
-        }
-        case FORBIDDEN_REQUEST:{
-            add_status_line(403, error_403_title);
-            add_headers(strlen(error_404_form));
-            if(!add_content(error_403_form)){ return false; }
+// 文件中[start, end)之间的内容：mmap模式下直接引用映射，sendfile模式下记为一段由write用sendfile发送
+bool http_conn::add_body(off_t start, off_t end){
+    if(m_file_address){ return add_iov(m_file_address + start, end - start); }
+    if(m_segment_count >= MAX_RANGES){ return false; }
+    file_segment& segment = m_request->segments[m_segment_count++];
+    segment.offset = start;
+    segment.end = end;
+    segment.iv_pos = m_iv_count;
+    m_sendfile_entry = m_file_entry;
+    m_bytes_to_send += end - start;
+    return true;
+}
+
+// 整个文件的200应答或单个区间的206应答：
+// 固定的状态行、写缓冲区中的Content-Length值和ETag等头部、固定的Connection头部以及文件内容
+bool http_conn::add_file(){
+    const response_table& table = response_table::instance();
+    bool partial = (m_range_count == 1);
+    off_t start = partial ? m_request->ranges[0].start : 0;
+    off_t end = partial ? m_request->ranges[0].end : m_file_stat.st_size;
+
+    const response_fragment& status = partial ? table.partial_prefix() : table.ok_prefix();
+    if(!add_iov(status.data, status.len)){ return false; }
+    int header = m_write_idx;
+    if(!append_uint(end - start) || !append("\r\n", 2) || !add_entity_headers()){ return false; }
+    if(partial){
+        if(!append("Content-Range: bytes ", 21) || !append_uint(start) || !append("-", 1) || !append_uint(end - 1)
+            || !append("/", 1) || !append_uint(m_file_stat.st_size) || !append("\r\n", 2)){ return false; }
+    }
+    if(!add_iov(m_write_buf + header, m_write_idx - header)){ return false; }
+    if(!add_linger()){ return false; }
+    if(m_method == HEAD){ return true; }
+    return add_body(start, end);
+}
+
+// 多个区间的206应答，消息体是multipart/byteranges：每个区间前面是分隔行和Content-Range，最后是结束分隔行
+// 各部分的头部先写进写缓冲区以便算出Content-Length，再按应答的顺序和文件内容交错放进iovec
+bool http_conn::add_multi_range(){
+    // 本批剩下的iovec放不下时不按区间回复，回复整个文件也是符合协议的
+    if(m_iv_count + 4 + 2 * m_range_count > MAX_IOV){
+        m_range_count = 0;
+        return add_file();
+    }
+
+    const response_table& table = response_table::instance();
+    const response_fragment& boundary = table.boundary();
+    int parts[MAX_RANGES + 1];
+    off_t content_length = 0;
+    for(int i = 0; i < m_range_count; ++i){
+        parts[i] = m_write_idx;
+        if(!append("\r\n--", 4) || !append(boundary.data, boundary.len) || !append("\r\nContent-Range: bytes ", 23)
+            || !append_uint(m_request->ranges[i].start) || !append("-", 1) || !append_uint(m_request->ranges[i].end - 1)
+            || !append("/", 1) || !append_uint(m_file_stat.st_size) || !append("\r\n\r\n", 4)){ return false; }
+        content_length += m_request->ranges[i].end - m_request->ranges[i].start;
+    }
+    parts[m_range_count] = m_write_idx;
+    if(!append("\r\n--", 4) || !append(boundary.data, boundary.len) || !append("--\r\n", 4)){ return false; }
+    content_length += m_write_idx - parts[0];
+
+    if(!add_iov(table.partial_prefix().data, table.partial_prefix().len)){ return false; }
+    int header = m_write_idx;
+    if(!append_uint(content_length) || !append("\r\n", 2) || !add_entity_headers()
+        || !append("Content-Type: multipart/byteranges; boundary=", 45) || !append(boundary.data, boundary.len)
+        || !append("\r\n", 2)){ return false; }
+    if(!add_iov(m_write_buf + header, m_write_idx - header)){ return false; }
+    if(!add_linger()){ return false; }
+    if(m_method == HEAD){ return true; }
+
+    // 写缓冲区不会再扩大，可以放心引用其中各部分的头部了
+    for(int i = 0; i < m_range_count; ++i){
+        if(!add_iov(m_write_buf + parts[i], parts[i + 1] - parts[i])){ return false; }
+        if(!add_body(m_request->ranges[i].start, m_request->ranges[i].end)){ return false; }
+    }
+    return add_iov(m_write_buf + parts[m_range_count], header - parts[m_range_count]);
+}
+
+// 304应答：没有消息体，只带上ETag、Last-Modified和Vary等头部
+bool http_conn::add_not_modified(){
+    const response_fragment& status = response_table::instance().not_modified();
+    if(!add_iov(status.data, status.len)){ return false; }
+    int header = m_write_idx;
+    if(!add_entity_headers()){ return false; }
+    if(!add_iov(m_write_buf + header, m_write_idx - header)){ return false; }
+    return add_linger();
+}
+
+// 416应答：告诉客户文件的实际大小
+bool http_conn::add_range_not_satisfiable(){
+    const response_fragment& status = response_table::instance().range_not_satisfiable();
+    if(!add_iov(status.data, status.len)){ return false; }
+    int header = m_write_idx;
+    if(!append_uint(m_file_stat.st_size) || !append("\r\n", 2)){ return false; }
+    if(!add_iov(m_write_buf + header, m_write_idx - header)){ return false; }
+    return add_linger();
+}
+
+// 动态内容的200应答：固定的状态行和Transfer-Encoding头部、写缓冲区中的Content-Type值以及固定的Connection头部
+// 消息体由write在发完这批应答之后逐块生成；HEAD请求不需要消息体，直接销毁m_producer
+bool http_conn::add_dynamic(){
+    const response_fragment& status = response_table::instance().chunked_prefix();
+    if(!add_iov(status.data, status.len)){ return false; }
+    int header = m_write_idx;
+    const char* type = m_producer->content_type();
+    if(!append(type, strlen(type)) || !append("\r\n", 2)){ return false; }
+    if(!add_iov(m_write_buf + header, m_write_idx - header)){ return false; }
+    if(!add_linger()){ return false; }
+    if(m_method == HEAD){
+        delete m_producer;
+        m_producer = 0;
+    }
+    return true;
+}
+
+// 本批的iovec都已发出，从头复用写缓冲区生成动态内容的下一个分块
+// 多次produce得到的数据连在一起作为一个分块，直到填满STREAM_CHUNK_SIZE或内容结束
+// 数据之前预留分块大小行的位置，生成完再把十六进制的长度倒着写在紧挨数据的地方，
+// 这样大小行、数据、结尾的CRLF以及内容结束时的空分块首尾相接，只占一个iovec
+// 返回false表示生成内容出错
+bool http_conn::next_chunk(){
+    static const int HEAD_SPACE = 2 * sizeof(long) + 2;
+    static const char* hex = "0123456789abcdef";
+    m_write_idx = 0;
+    m_iv_count = 0;
+    m_iv_idx = 0;
+    if(!reserve_write(STREAM_CHUNK_SIZE)){ return false; }
+
+    char* data = m_write_buf + HEAD_SPACE;
+    long capacity = STREAM_CHUNK_SIZE - HEAD_SPACE - 7; // 留出结尾的CRLF和空分块"0\r\n\r\n"
+    long len = 0;
+    bool end = false;
+    while(len < capacity){
+        long ret = m_producer->produce(data + len, capacity - len);
+        if(ret < 0 || ret > capacity - len){ return false; }
+        if(ret == 0){
+            end = true;
             break;
         }
-        case FILE_REQUEST:{
-            add_status_line(200, ok_200_title);
-            if(m_file_stat.st_size != 0){
-                add_headers(m_file_stat.st_size);
-                m_iv[0].iov_base = m_write_buf;
-                m_iv[0].iov_len = m_write_idx;
-                m_iv[1].iov_base = m_file_address;
-                m_iv[1].iov_len = m_file_stat.st_size;
-                m_iv_count = 2;
-                return true;
-            }
-            else{
-                const char* ok_string = "<html><body></body></html>";
-                add_headers(strlen(ok_string));
-                if(!add_content(ok_string)){ return false; }
-            }
+        len += ret;
+    }
+
+    char* begin = data;
+    char* tail = data;
+    if(len > 0){
+        *--begin = '\n';
+        *--begin = '\r';
+        for(long value = len; value > 0; value >>= 4){ *--begin = hex[value & 15]; }
+        tail = data + len;
+        *tail++ = '\r';
+        *tail++ = '\n';
+    }
+    if(end){
+        memcpy(tail, "0\r\n\r\n", 5);
+        tail += 5;
+        delete m_producer;
+        m_producer = 0;
+    }
+    m_write_idx = tail - m_write_buf;
+    if(m_record_count > 0){ m_batch->records[m_record_count - 1].bytes += tail - begin; }
+    return add_iov(begin, tail - begin);
+}
+
+// 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
+// 应答追加在本批已有的应答之后：错误应答和空文件的应答整个来自response_table，其它应答由上面的add_*函数拼成
+// HEAD请求和304应答都不发送文件内容，动态内容的消息体在write中生成
+bool http_conn::process_write(HTTP_CODE ret){
+    if(!alloc_batch()){ return false; }
+    long offset = m_bytes_have_send + m_bytes_to_send;
+    bool ok = false;
+    if(ret == FILE_REQUEST && m_file_stat.st_size != 0){ ok = (m_range_count > 1) ? add_multi_range() : add_file(); }
+    else if(ret == DYNAMIC_REQUEST){ ok = add_dynamic(); }
+    else if(ret == NOT_MODIFIED){ ok = add_not_modified(); }
+    else if(ret == RANGE_NOT_SATISFIABLE){ ok = add_range_not_satisfiable(); }
+    else{
+        const response_table& table = response_table::instance();
+        const response_fragment& response = (m_method == HEAD) ? table.head(ret, m_linger) : table.full(ret, m_linger);
+        ok = response.data && add_iov(response.data, response.len);
+    }
+    if(!ok){ return false; }
+
+    hold_file();
+    add_record(ret, offset);
+    ++m_responses;
+    return true;
+}
+
+// 登记这个应答，offset是它在本批中的起始偏移；开启了访问日志时在工作线程中格式化好日志的前半行
+void http_conn::add_record(HTTP_CODE ret, long offset){
+    if(m_record_count >= MAX_PIPELINE){ return; }
+    response_record& record = m_batch->records[m_record_count++];
+    record.code = ret;
+    record.start = m_request_start;
+    record.offset = offset;
+    record.bytes = m_bytes_have_send + m_bytes_to_send - offset;
+    record.text = m_log_idx;
+    record.len = 0;
+    metrics::instance()->observe(HISTOGRAM_PARSE, m_parse_time);
+    m_parse_time = 0;
+
+    if(!access_log::instance()->enabled()){ return; }
+    if(m_log_buf_size - m_log_idx < access_log::MAX_LINE){
+        char* buf = m_log_buf ? buffer_pool::instance()->grow(m_log_buf, &m_log_buf_size, m_log_idx, m_log_buf_size * 2)
+            : buffer_pool::instance()->alloc(access_log::MAX_LINE, &m_log_buf_size);
+        if(!buf){ return; }
+        m_log_buf = buf;
+    }
+    record.len = access_log::format_prefix(m_log_buf + m_log_idx, m_address, method_names[m_method], m_url,
+        status_of(ret, m_range_count > 0));
+    m_log_idx += record.len;
+}
+
+// write每发出一些数据就检查是否有应答的第一个字节刚刚发出
+void http_conn::first_bytes_sent(){
+    while(m_first_byte_idx < m_record_count && m_batch->records[m_first_byte_idx].offset < m_bytes_have_send){
+        long long now = metrics::now_us();
+        metrics::instance()->observe(HISTOGRAM_FIRST_BYTE, now - m_batch->records[m_first_byte_idx].start);
+        ++m_first_byte_idx;
+    }
+}
+
+// 一批应答发完，或者连接在发送途中关闭时，记下这批应答的总耗时和字节数，并写出访问日志
+// 每个应答实际发出的字节数由整批的发送进度推算，连接中途关闭时后面的应答可能只发出一部分或完全没有发出
+void http_conn::log_responses(){
+    if(m_record_count > 0){
+        long long now = metrics::now_us();
+        metrics* m = metrics::instance();
+        for(int i = 0; i < m_record_count; ++i){
+            const response_record& record = m_batch->records[i];
+            long sent = m_bytes_have_send - record.offset;
+            if(sent < 0){ sent = 0; }
+            if(sent > record.bytes){ sent = record.bytes; }
+            m->observe(HISTOGRAM_TOTAL, now - record.start);
+            m->count_response(record.code, sent);
+            if(record.len > 0){ access_log::instance()->append(m_log_buf + record.text, record.len, sent, now - record.start); }
         }
-        default:{ return false; }
+        m_record_count = 0;
+        m_first_byte_idx = 0;
+    }
+    buffer_pool::instance()->free(m_log_buf, m_log_buf_size);
+    m_log_buf = 0;
+    m_log_buf_size = 0;
+    m_log_idx = 0;
+}
+
+void http_conn::render_metrics(std::string* out){
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP http_connections Open client connections.\n# TYPE http_connections gauge\n"
+        "http_connections %d\n", m_conn_stats.current.load(std::memory_order_relaxed));
+    out->append(line);
+    snprintf(line, sizeof(line), "# HELP http_connections_total Client connections by outcome.\n"
+        "# TYPE http_connections_total counter\nhttp_connections_total{event=\"accepted\"} %lu\n"
+        "http_connections_total{event=\"closed\"} %lu\nhttp_connections_total{event=\"rejected\"} %lu\n",
+        m_conn_stats.accepted.load(std::memory_order_relaxed), m_conn_stats.closed.load(std::memory_order_relaxed),
+        m_conn_stats.rejected.load(std::memory_order_relaxed));
+    out->append(line);
+    out->append("# HELP http_responses_total Responses by processing result.\n"
+        "# TYPE http_responses_total counter\n");
+    metrics* m = metrics::instance();
+    for(int code = BAD_REQUEST; code < CLOSED_CONNECTION; ++code){
+        if(code == GET_REQUEST){ continue; }
+        snprintf(line, sizeof(line), "http_responses_total{result=\"%s\"} %llu\n", code_names[code], m->responses(code));
+        out->append(line);
     }
+    snprintf(line, sizeof(line), "# HELP http_sent_bytes_total Bytes sent in responses.\n"
+        "# TYPE http_sent_bytes_total counter\nhttp_sent_bytes_total %llu\n", m->bytes());
+    out->append(line);
+    snprintf(line, sizeof(line), "# HELP access_log_dropped_lines_total Access log lines lost because the buffer was full.\n"
+        "# TYPE access_log_dropped_lines_total counter\naccess_log_dropped_lines_total %lu\n",
+        access_log::instance()->dropped());
+    out->append(line);
+    m->render_histogram(out, HISTOGRAM_QUEUE_WAIT, "http_queue_wait_seconds",
+        "Time requests waited in the thread pool queue.");
+    m->render_histogram(out, HISTOGRAM_PARSE, "http_parse_seconds", "Time spent parsing and routing a request.");
+    m->render_histogram(out, HISTOGRAM_FIRST_BYTE, "http_first_byte_seconds",
+        "Time from reading a request to sending the first response byte.");
+    m->render_histogram(out, HISTOGRAM_TOTAL, "http_request_seconds",
+        "Time from reading a request to sending the whole response.");
 }
 
 // 由线程池中的工作线程调用，这是处理HTTP请求的入口函数
+// 读缓冲区中可能有客户以流水线方式连续发来的多个请求，逐个解析并把它们的应答合成一批，由一次writev发出
 void http_conn::process(){
-    HTTP_CODE read_ret = process_read();
-    if(read_ret == NO_REQUEST){
+    while(true){
+        long long begin = metrics::now_us();
+        HTTP_CODE read_ret = process_read();
+        m_parse_time += metrics::now_us() - begin;
+        if(read_ret == NO_REQUEST){
+            // 读缓冲区已经扩大到上限并且被一个请求的请求行和头部占满，这个请求再也收不完了
+            if(m_check_state == CHECK_STATE_CONTENT || m_read_buf_size < MAX_READ_BUFFER_SIZE
+                || m_read_idx < m_read_buf_size){ break; }
+            read_ret = BAD_REQUEST;
+        }
+
+        // 请求有语法错误，或者消息体没有收完就出错时，无法确定下一个请求从哪里开始，回复之后就关闭连接
+        if(read_ret == BAD_REQUEST || read_ret == INTERNAL_ERROR){ m_linger = false; }
+        // 服务器正在停止，告诉客户这个应答之后连接就会关闭
+        if(m_draining.load(std::memory_order_relaxed)){ m_linger = false; }
+
+        bool write_ret = process_write(read_ret);
+        if(!write_ret){
+            close_conn();
+            return;
+        }
+        m_keep_alive = m_linger;
+        finish_request();
+
+        // 连接在这个应答之后就要关闭、这一批已满，或者sendfile发送的文件内容和动态内容必须位于一批的最后时，先把这一批发出去
+        if(!m_keep_alive || m_responses >= MAX_PIPELINE || m_iv_count + IOV_PER_RESPONSE > MAX_IOV || m_sendfile_entry
+            || m_producer){ break; }
+    }
+
+    if(m_responses == 0){
         // 请求不完整，还要读取更多数据，所以需要监听对应socket接收的消息
         modfd(m_epollfd, m_sockfd, EPOLLIN);
         return;
     }
-
-    bool write_ret = process_write(read_ret);
-    if(!write_ret){
-        close_conn();
-    }
-
     modfd(m_epollfd, m_sockfd, EPOLLOUT);
 }
-
@@ -19,17 +19,47 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <atomic>
 
 #include "locker.h"
+#include "file_cache.h"
+#include "buffer_pool.h"
+#include "line_scanner.h"
+#include "router.h"
+#include "header_table.h"
+#include "log.h"
+#include "access_log.h"
+#include "metrics.h"
+
+// 连接计数，每个计数器独占一个缓存行
+// current在主线程的init中加一，在close_conn中减一，后者可能在工作线程中调用，所以都是原子变量，
+// 主线程据此做接纳控制，导出指标时也可以直接读取而不用加锁
+struct conn_stats{
+    alignas(64) std::atomic<int> current;            // 当前打开的连接数
+    alignas(64) std::atomic<unsigned long> accepted; // 累计接受的连接数
+    alignas(64) std::atomic<unsigned long> closed;   // 累计关闭的连接数
+    alignas(64) std::atomic<unsigned long> rejected; // 因连接数达到上限而拒绝的连接数
+};
 
 class http_conn
 {
+    friend class conn_reset_bench; // bench_conn_reset.cpp直接调用私有的重置函数
 public:
     static const int FILENAME_LEN = 200;       // 文件名最大长度
-    static const int READ_BUFFER_SIZE = 2048;  // 读缓冲区大小
-    static const int WRITE_BUFFER_SIZE = 1024; // 写缓冲区大小
+    static const int READ_BUFFER_SIZE = 2048;  // 读缓冲区的初始大小
+    static const int WRITE_BUFFER_SIZE = 1024; // 写缓冲区的初始大小
+    static const int MAX_READ_BUFFER_SIZE = buffer_pool::MAX_SIZE;  // 读缓冲区最多扩大到的大小，即请求头部的长度上限
+    static const int MAX_WRITE_BUFFER_SIZE = buffer_pool::MAX_SIZE; // 写缓冲区最多扩大到的大小
+    static const int MAX_PIPELINE = 16;        // 一批最多合并发送的流水线应答数
+    static const int IOV_PER_RESPONSE = 4;     // 每个应答最多占用的iovec数：状态行、Content-Length等头部、Connection头部和文件内容
+    static const int MAX_IOV = IOV_PER_RESPONSE * MAX_PIPELINE;
+    static const int MAX_RANGES = 16;          // 一个Range请求最多的区间数，超过时忽略Range头部、回复整个文件
+    static_assert(MAX_READ_BUFFER_SIZE <= 65536, "header_table stores 16-bit offsets into the read buffer");
+    static const int MAX_CHUNK_LINE = 1024;    // 分块编码中分块大小行和尾部头部行的最大长度
+    static const int STREAM_CHUNK_SIZE = 16 * 1024; // 动态内容的一个分块连同分块大小行和结尾的CRLF在写缓冲区中占用的最大字节数
 
-    // HTTP请求方法，但我们仅支持GET
+    // HTTP请求方法，但我们仅支持GET、HEAD和POST
     enum METHOD
     {
         GET = 0,
@@ -57,6 +87,11 @@ public:
     // GET_REQUEST表示获得了一个完整的客户请求
     // BAD_REQUEST表示客户请求有语法错误
     // FORBIDDEN_REQUEST表示客户对资源没有足够的访问权限
+    // DYNAMIC_REQUEST表示应答内容由response_producer生成
+    // NOT_MODIFIED表示条件请求的目标文件没有被修改过，只需回复304
+    // RANGE_NOT_SATISFIABLE表示Range请求的区间都在文件之外，回复416
+    // NO_CONTENT表示POST请求的消息体已经被body_handler成功处理，回复204
+    // METHOD_NOT_ALLOWED表示没有body_handler接受这个POST请求，回复405
     // INTERNAL_ERROR表示服务器内部错误
     // CLOSED_CONNECTION表示客户端已经关闭连接了
     enum HTTP_CODE
@@ -67,10 +102,24 @@ public:
         NO_RESOURCE,
         FORBIDDEN_REQUEST,
         FILE_REQUEST,
+        DYNAMIC_REQUEST,
+        NOT_MODIFIED,
+        RANGE_NOT_SATISFIABLE,
+        NO_CONTENT,
+        METHOD_NOT_ALLOWED,
         INTERNAL_ERROR,
         CLOSED_CONNECTION
     }; // 服务器处理HTTP请求的可能结果
 
+    // 分块编码的消息体的解析状态：分块大小行、分块数据、分块数据之后的CRLF、最后一个分块之后的尾部头部
+    enum CHUNK_STATE
+    {
+        CHUNK_SIZE = 0,
+        CHUNK_DATA,
+        CHUNK_DATA_END,
+        CHUNK_TRAILER
+    };
+
     // 从状态机的三种可能状态，即行的读取状态
     // 分别表示：读取到一个完整的行、行出错以及行数据暂且不完整
     enum LINE_STATUS
@@ -90,60 +139,164 @@ public:
     void process();                                 // 处理客户请求
     bool read();                                    // 非阻塞读操作
     bool write();                                   // 非阻塞写操作
+    // 应答已经全部发出，而读缓冲区中还有已读入但未处理的数据（流水线中的后续请求）
+    // write返回true且此函数也返回true时，连接没有重新注册事件，调用者应直接把它交给线程池
+    bool has_buffered_request() const { return m_responses == 0 && m_read_idx > 0; }
+    // 连接空闲：在等待下一个请求，没有交给线程池。只由主线程修改，所以主线程可以据此直接关闭它
+    bool idle() const { return m_idle; }
+    // 设置请求的路由，应在启动时、第一个请求到来之前设置；没有设置时所有url都映射到网站根目录下的文件
+    static void set_router(router *routes);
+    // 以Prometheus文本格式输出连接数、按处理结果分类的应答数、发送的字节数和各段延迟的直方图
+    static void render_metrics(std::string *out);
 
 private:
     void init();                       // 初始化连接
+    void reset_request();              // 准备解析下一个请求
+    void reset_write();                // 准备填充下一批应答
+    void finish_request();             // 从读缓冲区中移走已经处理完的请求
+    bool finish_write();               // 一批应答发送完毕后的收尾
     HTTP_CODE process_read();          // 解析HTTP请求
     bool process_write(HTTP_CODE ret); // 填充HTTP应答
 
     // 下面这一组函数被process_read调用用以分析HTTP请求
     HTTP_CODE parse_request_line(char *text);
     HTTP_CODE parse_headers(char *text);
-    HTTP_CODE parse_content(char *text);
+    HTTP_CODE parse_content();
+    HTTP_CODE decode_body(int *pos);
+    bool feed_body(int *pos, long len);
+    HTTP_CODE begin_body();
+    HTTP_CODE end_body();
     HTTP_CODE do_request();
+    bool not_modified() const;
+    void choose_encoding();
+    int parse_ranges();
     char *get_line() { return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
 
+    // 读写缓冲区和一批应答的状态按需从buffer_pool获取，读写缓冲区放不下时扩大一倍，连接空闲时归还
+    bool grow_read_buf();
+    bool grow_write_buf();
+    bool alloc_batch();
+    void free_buffers();
+
     // 下面这一组函数被process_write调用以填充HTTP应答
     void unmap();
-    bool add_response(const char *format, ...);
-    bool add_content(const char *content);
-    bool add_status_line(int status, const char *titile);
-    bool add_headers(int content_length);
-    bool add_content_length(int content_length);
+    void hold_file();
+    bool add_iov(const char *base, size_t len);
+    bool reserve_write(int len);
+    bool append(const char *data, int len);
+    bool append_uint(unsigned long long value);
     bool add_linger();
-    bool add_blank_line();
+    bool add_entity_headers();
+    bool add_body(off_t start, off_t end);
+    bool add_file();
+    bool add_multi_range();
+    bool add_not_modified();
+    bool add_range_not_satisfiable();
+    bool add_dynamic();
+    bool next_chunk();
+
+    // process_write为每个应答登记一条记录，发出第一个字节时记下首字节延迟，
+    // 整批发完或连接关闭时记下总耗时和字节数，并补全访问日志写出
+    void add_record(HTTP_CODE ret, long offset);
+    void first_bytes_sent();
+    void log_responses();
 
 public:
     static int m_epollfd;    // 所有socket上的事件都被注册到同一个epoll内核事件表中，所以将epoll文件描述符设置为静态的
-    static int m_user_count; // 统计用户数量
+    static conn_stats m_conn_stats; // 统计用户数量
+    static const router *m_router; // 按url找到处理请求的request_handler
+    static std::atomic<bool> m_draining; // 服务器正在停止，之后的应答都带"Connection: close"，发完就关闭连接
 
 private:
     // 该HTTP连接的socket和对方的socket地址
     int m_sockfd;
     sockaddr_in m_address;
 
-    char m_read_buf[READ_BUFFER_SIZE];   // 读缓冲区
+    char *m_read_buf;                    // 读缓冲区，连接空闲时为NULL
+    int m_read_buf_size;                 // 读缓冲区的大小
     int m_read_idx;                      // 标识读缓冲区中已经读入的客户数据的最后一个字节的下一个位置
     int m_checked_idx;                   // 当前正在分析的字符在读缓冲区的位置
     int m_start_line;                    // 当前正在解析的行的起始位置
-    char m_write_buf[WRITE_BUFFER_SIZE]; // 写缓冲区
+    char *m_write_buf;                   // 写缓冲区，连接空闲时为NULL
+    int m_write_buf_size;                // 写缓冲区的大小
     int m_write_idx;                     // 写缓冲区中待发送的字节数
 
     CHECK_STATE m_check_state; // 主状态机当前所处的状态
     METHOD m_method;           // 请求方法
 
-    char m_real_file[FILENAME_LEN]; // 客户请求的目标文件的完整路径，其内容等于doc_root + m_url，其中doc_root是网站根目录
     char *m_url;                    // 客户请求的目标文件的文件名
     char *m_version;                // HTTP协议版本号，我们仅支持HTTP/1.1
-    char *m_host;                   // 主机名
-    int m_content_length;           // HTTP请求的消息体的长度
+    bool m_accept_gzip;             // 客户是否接受gzip编码的应答
+    bool m_gzip;                    // 是否发送文件的gzip压缩版本
+    bool m_vary;                    // 应答是否随Accept-Encoding变化，是则要带上Vary头部
+    long m_content_length;          // HTTP请求的消息体的长度
+    bool m_chunked;                 // 消息体是否采用分块编码
+    bool m_expect_continue;         // 客户是否在等100 Continue之后才发送消息体
+    CHUNK_STATE m_chunk_state;      // 分块编码的消息体的解析状态
+    long m_body_remaining;          // 消息体（分块编码时是当前分块）中还没有收到的字节数
+    body_handler *m_body_handler;   // 当前请求消息体的处理者，为NULL时消息体被丢弃
     bool m_linger;                  // HTTP请求是否要求保持连接
 
+    file_entry *m_file_entry; // 目标文件在file_cache中的映射，请求结束后要归还给缓存
     char *m_file_address;    // 客户请求的目标文件被mmap到内存中的起始位置
     struct stat m_file_stat; // 目标文件的状态，通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小信息
-    struct iovec m_iv[2];    // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量
-    int m_iv_count;          // 见书上5.8.3节
+    int m_range_count;       // Range请求中能满足的区间数，为0表示回复整个文件
+    int m_iv_count;          // 本批用到的iovec数量，见书上5.8.3节
+    int m_iv_idx;            // 第一个还没有发送完的iovec
+    long m_bytes_to_send;    // 本批应答中还没有发送的字节数
+    long m_bytes_have_send;  // 本批应答中已经发送的字节数
+    int m_responses;         // 本批已经填充的应答数
+    bool m_keep_alive;       // 本批应答发送完之后是否保持连接，即最后一个请求的m_linger
+    bool m_idle;             // 见idle()
+
+    int m_batch_file_count;  // 本批应答引用的文件数
+    file_entry *m_sendfile_entry; // sendfile模式下本批最后一个应答要发送的文件
+    int m_segment_count;     // sendfile模式下要发送的文件内容的段数
+    int m_segment_idx;       // 第一段还没有发送完的文件内容
+    // 本批最后一个应答的动态内容，iovec中的数据都发出之后再生成下一个分块，内容结束后销毁
+    response_producer *m_producer;
+
+    long long m_read_time;     // 最近一次读入数据的时刻（微秒，单调时钟）
+    long long m_request_start; // 当前请求的第一个字节被读入的时刻
+    long long m_parse_time;    // 当前请求已经花在process_read上的时间
+    // 本批的每个应答：处理结果，请求开始的时刻，它在整批中的起始偏移和字节数，以及访问日志前半行在m_log_buf中的位置
+    struct response_record{ HTTP_CODE code; long long start; long offset; long bytes; int text; int len; };
+    int m_record_count;
+    int m_first_byte_idx;      // 第一个还没有发出任何字节的应答
+    char *m_log_buf;           // 本批的访问日志，没有开启访问日志时为NULL
+    int m_log_buf_size;
+    int m_log_idx;
+
+    // 一批应答用到的数组，与写缓冲区一样在填充应答时才从buffer_pool获取，这批发完或连接关闭时归还，
+    // 空闲的连接不占用这部分内存；各数组中的有效元素数由上面的m_iv_count等计数给出
+    struct batch_state{
+        struct iovec iv[MAX_IOV];         // 我们将采用writev来执行写操作
+        file_entry *files[MAX_PIPELINE];  // 本批应答引用的文件，发送完毕后归还给file_cache
+        response_record records[MAX_PIPELINE];
+    };
+    static_assert(sizeof(batch_state) <= buffer_pool::MAX_SIZE, "batch_state is allocated from buffer_pool");
+    batch_state *m_batch;      // 没有正在填充或发送的应答时为NULL
+    int m_batch_size;
+
+    // 解析请求用到的表，和读缓冲区一起从buffer_pool获取、一起归还
+    // sendfile只用于一批中的最后一个应答，即最后解析的那个请求，所以它的文件内容的分段也放在这里
+    struct byte_range{ off_t start; off_t end; }; // 文件中[start, end)之间的字节
+    struct file_segment{ off_t offset; off_t end; int iv_pos; };
+    struct request_state{
+        char real_file[FILENAME_LEN];     // 客户请求的目标文件的完整路径，由url对应的request_handler给出
+        header_table headers;             // 全部请求头部，Host、Range和条件请求等头部在用到时从中取值
+        byte_range ranges[MAX_RANGES];    // Range请求中能满足的区间，已经截到文件大小之内
+        // sendfile模式下要发送的文件内容，多区间应答有多段，每段排在第iv_pos个iovec之前，offset是这段的发送进度
+        file_segment segments[MAX_RANGES];
+    };
+    static_assert(sizeof(request_state) <= buffer_pool::MAX_SIZE, "request_state is allocated from buffer_pool");
+    request_state *m_request;  // 连接空闲时为NULL
+    int m_request_size;
 };
 
+// users数组为每个可能的文件描述符预留一个http_conn，空闲连接占用的内存只有这个对象本身，
+// 请求和应答用到的数组都应放在request_state和batch_state中
+static_assert(sizeof(http_conn) <= 512, "keep per-request state out of http_conn");
+
 #endif
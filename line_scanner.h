@@ -0,0 +1,173 @@
+// HTTP请求的向量化扫描
+// http_conn::parse_line原来逐字节寻找'\r'和'\n'，这里改为每次检查16（SSE2）或32（AVX2）字节
+// x86_64上总是有SSE2，直接内联调用，其它平台退回到查表的逐字节扫描
+// AVX2实现只在bench_line_scanner中参与比较：请求头大多是几十字节的短行，它并不比SSE2快
+#ifndef LINE_SCANNER_H
+#define LINE_SCANNER_H
+
+#include <stddef.h>
+
+#if defined(__x86_64__)
+#define LINE_SCANNER_X86
+#include <immintrin.h>
+#endif
+
+namespace line_scanner{
+
+// 每个字节的类别，逐字节扫描时每个字节只需一次查表
+enum{
+    // 停止字节：'\r'、'\n'以及除'\t'之外的其它控制字符（0x00~0x1f和0x7f）
+    // 请求行和头部中只有行尾会出现'\r'和'\n'，其它控制字符都是非法的，所以扫描时一并找出来交给调用者处理
+    CLASS_STOP = 1,
+    // token字符（RFC 7230第3.2.6节）：0x21~0x7e中除去分隔符"(),/:;<=>?@[\]{}，请求方法和头部字段名只能由它们组成
+    CLASS_TOKEN = 2
+};
+
+static const unsigned char char_class[256] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    0, 2, 0, 2, 2, 2, 2, 2, 0, 0, 2, 2, 0, 2, 2, 0,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0, 0,
+    0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 2, 0, 2, 1,
+    // 0x80~0xff既不是停止字节也不是token字符
+};
+
+// 逐字节实现，也用来处理向量实现剩下的不足一个块的尾部
+inline size_t find_stop_scalar(const char* buf, size_t len){
+    for(size_t i = 0; i < len; ++i){
+        if(char_class[(unsigned char)buf[i]] & CLASS_STOP){ return i; }
+    }
+    return len;
+}
+
+inline size_t find_non_token_scalar(const char* buf, size_t len){
+    for(size_t i = 0; i < len; ++i){
+        if(!(char_class[(unsigned char)buf[i]] & CLASS_TOKEN)){ return i; }
+    }
+    return len;
+}
+
+#ifdef LINE_SCANNER_X86
+// P是指令前缀（_mm或_mm256），W是整数向量类型后缀（si128或si256）
+// 无符号比较：x在[lo, lo + span]之内的字节置为0xff
+#define LS_IN_RANGE(P, x, lo, span) \
+    P##_cmpeq_epi8(P##_min_epu8(P##_sub_epi8((x), P##_set1_epi8(lo)), P##_set1_epi8(span)), \
+        P##_sub_epi8((x), P##_set1_epi8(lo)))
+
+// 块内的停止字节掩码：小于0x20且不是'\t'，或者等于0x7f
+#define LS_STOP_MASK(P, W, x) \
+    P##_or_##W(P##_andnot_##W(P##_cmpeq_epi8((x), P##_set1_epi8('\t')), LS_IN_RANGE(P, x, 0x00, 0x1f)), \
+        P##_cmpeq_epi8((x), P##_set1_epi8(0x7f)))
+
+// 块内的非token字节掩码：不在0x21~0x7e之内，或者是分隔符
+// 分隔符中的"()"、":;<=>?@"和"[\]"各是一段连续的区间，其余5个单独比较
+#define LS_NON_TOKEN_MASK(P, W, x) \
+    P##_or_##W( \
+        P##_or_##W( \
+            P##_or_##W(P##_xor_##W(LS_IN_RANGE(P, x, 0x21, 0x5d), P##_set1_epi8(-1)), LS_IN_RANGE(P, x, 0x28, 0x01)), \
+            P##_or_##W(LS_IN_RANGE(P, x, 0x3a, 0x06), LS_IN_RANGE(P, x, 0x5b, 0x02))), \
+        P##_or_##W( \
+            P##_or_##W(P##_cmpeq_epi8((x), P##_set1_epi8('"')), P##_cmpeq_epi8((x), P##_set1_epi8(','))), \
+            P##_or_##W(P##_cmpeq_epi8((x), P##_set1_epi8('/')), \
+                P##_or_##W(P##_cmpeq_epi8((x), P##_set1_epi8('{')), P##_cmpeq_epi8((x), P##_set1_epi8('}'))))))
+
+// x86_64都支持SSE2，不需要target属性
+inline size_t find_stop_sse2(const char* buf, size_t len){
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16){
+        __m128i x = _mm_loadu_si128((const __m128i*)(buf + i));
+        int mask = _mm_movemask_epi8(LS_STOP_MASK(_mm, si128, x));
+        if(mask){ return i + __builtin_ctz(mask); }
+    }
+    return i + find_stop_scalar(buf + i, len - i);
+}
+
+inline size_t find_non_token_sse2(const char* buf, size_t len){
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16){
+        __m128i x = _mm_loadu_si128((const __m128i*)(buf + i));
+        int mask = _mm_movemask_epi8(LS_NON_TOKEN_MASK(_mm, si128, x));
+        if(mask){ return i + __builtin_ctz(mask); }
+    }
+    return i + find_non_token_scalar(buf + i, len - i);
+}
+
+// 大多数头部行不到32字节，先用SSE2检查前16字节，找不到再按32字节一块扫描
+__attribute__((target("avx2"))) inline size_t find_stop_avx2(const char* buf, size_t len){
+    if(len < 16){ return find_stop_scalar(buf, len); }
+    int head = _mm_movemask_epi8(LS_STOP_MASK(_mm, si128, _mm_loadu_si128((const __m128i*)buf)));
+    if(head){ return __builtin_ctz(head); }
+    size_t i = 16;
+    for(; i + 32 <= len; i += 32){
+        __m256i x = _mm256_loadu_si256((const __m256i*)(buf + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(LS_STOP_MASK(_mm256, si256, x));
+        if(mask){ return i + __builtin_ctz(mask); }
+    }
+    return i + find_stop_sse2(buf + i, len - i);
+}
+
+__attribute__((target("avx2"))) inline size_t find_non_token_avx2(const char* buf, size_t len){
+    if(len < 16){ return find_non_token_scalar(buf, len); }
+    int head = _mm_movemask_epi8(LS_NON_TOKEN_MASK(_mm, si128, _mm_loadu_si128((const __m128i*)buf)));
+    if(head){ return __builtin_ctz(head); }
+    size_t i = 16;
+    for(; i + 32 <= len; i += 32){
+        __m256i x = _mm256_loadu_si256((const __m256i*)(buf + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(LS_NON_TOKEN_MASK(_mm256, si256, x));
+        if(mask){ return i + __builtin_ctz(mask); }
+    }
+    return i + find_non_token_sse2(buf + i, len - i);
+}
+
+#undef LS_IN_RANGE
+#undef LS_STOP_MASK
+#undef LS_NON_TOKEN_MASK
+#endif
+
+// 可选的实现，基准测试程序bench_line_scanner.cpp会逐个比较它们
+enum IMPL{ IMPL_SCALAR = 0, IMPL_SSE2, IMPL_AVX2 };
+
+// find_stop和find_non_token使用的实现
+inline IMPL default_impl(){
+#ifdef LINE_SCANNER_X86
+    return IMPL_SSE2;
+#else
+    return IMPL_SCALAR;
+#endif
+}
+
+// 当前CPU能运行的最宽的实现
+inline IMPL widest_impl(){
+#ifdef LINE_SCANNER_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){ return IMPL_AVX2; }
+    return IMPL_SSE2;
+#else
+    return IMPL_SCALAR;
+#endif
+}
+
+// 返回buf中第一个停止字节的下标，没有则返回len
+inline size_t find_stop(const char* buf, size_t len){
+#ifdef LINE_SCANNER_X86
+    return find_stop_sse2(buf, len);
+#else
+    return find_stop_scalar(buf, len);
+#endif
+}
+
+// 返回buf中第一个非token字节的下标，没有则返回len
+inline size_t find_non_token(const char* buf, size_t len){
+#ifdef LINE_SCANNER_X86
+    return find_non_token_sse2(buf, len);
+#else
+    return find_non_token_scalar(buf, len);
+#endif
+}
+
+}
+
+#endif
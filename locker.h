@@ -6,6 +6,7 @@
 #include<exception>
 #include<pthread.h>
 #include<semaphore.h>
+#include<time.h>
 
 // 封装信号量的类
 class sem{
@@ -23,6 +24,19 @@ class sem{
     // 等待信号量
     bool wait(){ return sem_wait(&m_sem) == 0; }
 
+    // 最多等待ms毫秒，超时或被信号打断时返回false
+    bool timedwait(int ms){
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += ms / 1000;
+        ts.tv_nsec += (ms % 1000) * 1000000L;
+        if(ts.tv_nsec >= 1000000000L){
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        return sem_timedwait(&m_sem, &ts) == 0;
+    }
+
     // 增加信号量
     bool post(){ return sem_post(&m_sem) == 0; }
 };
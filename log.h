@@ -0,0 +1,377 @@
+// 分级日志
+// LOG_LEVEL在编译时决定输出哪些级别，低于它的LOG_xxx宏展开为空语句，参数都不会被求值
+// 输出的级别也不在调用线程中写stdout，而是交给log_channel由后台线程批量写出
+// 编译时用-DLOG_LEVEL=LOG_LEVEL_DEBUG打开调试日志
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <string>
+
+#include "locker.h"
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF   4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logger::instance()->log(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) logger::instance()->log(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) logger::instance()->log(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logger::instance()->log(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void)0)
+#endif
+
+// 多个线程写、一个后台线程批量写出的日志通道
+// 每个线程把格式化好的若干行追加到自己在这个通道中的环形缓冲区，只有这个线程写、后台线程读，不需要加锁；
+// 后台线程定期把所有缓冲区中的内容用一次writev写出；某个缓冲区用掉一半以上时立即唤醒后台线程，不等到下一个周期；
+// 缓冲区满时丢弃新的日志并计数，而不是阻塞写日志的线程
+// 后台线程一直在运行，所以通道创建之后从不销毁
+class log_channel{
+    public:
+    static const int MAX_CHANNELS = 4;       // 最多的通道数
+    static const int MAX_THREADS = 256;      // 每个通道最多能写日志的线程数，更多的线程的日志被丢弃
+    static const int RING_SIZE = 64 * 1024;  // 每个线程的环形缓冲区的默认大小
+    static const int DRAIN_INTERVAL_MS = 10; // 后台线程检查缓冲区的间隔
+
+    // ring_size是这个通道中每个线程的环形缓冲区大小，必须是2的幂
+    explicit log_channel(int fd, size_t ring_size = RING_SIZE): m_fd(fd), m_ring_size(ring_size), m_ring_count(0),
+        m_started(false), m_reopen(false), m_wake_pending(false), m_dropped(0){
+        s_lock.lock();
+        if(s_count == 0){
+            pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+            atexit(flush_all);
+        }
+        m_id = s_count;
+        if(s_count < MAX_CHANNELS){ s_channels[s_count++] = this; }
+        s_lock.unlock();
+    }
+
+    // 输出到fd，应在第一次写日志之前设置
+    void set_fd(int fd){ m_fd = fd; }
+
+    // 以追加方式打开path作为输出，之后可以用reopen重新打开
+    bool open(const char* path){
+        m_path = path;
+        int fd = ::open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if(fd < 0){ return false; }
+        m_fd = fd;
+        return true;
+    }
+
+    // 日志文件被改名（轮转）之后，让后台线程在下一次写出之前重新打开path，在哪个线程中调用都可以
+    void reopen(){ m_reopen.store(true, std::memory_order_release); }
+
+    // 追加若干完整的行，缓冲区满时整体丢弃
+    void append(const char* data, size_t len){
+        ring* r = local_ring();
+        if(!r){ return; }
+        if(!m_started.load(std::memory_order_acquire)){ start(); }
+        // 用掉一半以上时提前写出，每个周期只post一次
+        if(r->push(data, len) > m_ring_size / 2 && !m_wake_pending.load(std::memory_order_relaxed)
+            && !m_wake_pending.exchange(true, std::memory_order_relaxed)){
+            m_wakeup.post();
+        }
+    }
+
+    // 因缓冲区满而丢弃的行数
+    unsigned long dropped() const {
+        unsigned long total = 0;
+        int count = m_ring_count.load(std::memory_order_acquire);
+        for(int i = 0; i < count; ++i){ total += m_rings[i]->dropped.load(std::memory_order_relaxed); }
+        return total;
+    }
+
+    // 调用线程在这个通道中的编号，线程太多时返回-1
+    int thread_id(){
+        ring* r = local_ring();
+        return r ? r->id : -1;
+    }
+
+    // 把所有缓冲区中的日志立即写出，程序退出时会自动调用
+    void flush(){
+        m_drain_lock.lock();
+        if(m_reopen.exchange(false, std::memory_order_acquire) && !m_path.empty()){
+            int fd = ::open(m_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+            if(fd >= 0){
+                close(m_fd);
+                m_fd = fd;
+            }
+        }
+        drain();
+        m_drain_lock.unlock();
+    }
+
+    private:
+    // 单生产者单消费者的字节环，head和tail只增不减，分开放在两个缓存行中
+    struct ring{
+        ring(int i, size_t s): id(i), size(s), buf(new char[s]), head(0), tail(0), dropped(0){}
+
+        // 返回放入之后（或放不下时）已经使用的字节数
+        size_t push(const char* data, size_t len){
+            size_t h = head.load(std::memory_order_relaxed);
+            size_t t = tail.load(std::memory_order_acquire);
+            if(size - (h - t) < len){
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return h - t;
+            }
+            size_t pos = h & (size - 1);
+            size_t first = (len < size - pos) ? len : size - pos;
+            memcpy(buf + pos, data, first);
+            memcpy(buf, data + first, len - first);
+            head.store(h + len, std::memory_order_release);
+            return h + len - t;
+        }
+
+        int id;
+        size_t size;
+        char* buf;
+        alignas(64) std::atomic<size_t> head;
+        alignas(64) std::atomic<size_t> tail;
+        std::atomic<unsigned long> dropped;
+    };
+
+    // 调用线程的环形缓冲区，第一次写日志时创建，线程退出后也不释放（线程池中的线程与进程同寿）
+    ring* local_ring(){
+        static thread_local ring* rings[MAX_CHANNELS] = {};
+        static thread_local bool full[MAX_CHANNELS] = {};
+        if(m_id >= MAX_CHANNELS){ return NULL; }
+        ring*& r = rings[m_id];
+        if(r || full[m_id]){ return r; }
+        m_lock.lock();
+        int count = m_ring_count.load(std::memory_order_relaxed);
+        if(count < MAX_THREADS){
+            r = new ring(count, m_ring_size);
+            m_rings[count] = r;
+            m_ring_count.store(count + 1, std::memory_order_release);
+        }
+        m_lock.unlock();
+        full[m_id] = !r;
+        return r;
+    }
+
+    void start(){
+        m_lock.lock();
+        if(!m_started.load(std::memory_order_relaxed)){
+            pthread_t tid;
+            if(pthread_create(&tid, NULL, drainer, this) == 0){ pthread_detach(tid); }
+            m_started.store(true, std::memory_order_release);
+        }
+        m_lock.unlock();
+    }
+
+    static void* drainer(void* arg){
+        log_channel* channel = (log_channel*)arg;
+        while(true){
+            channel->m_wakeup.timedwait(DRAIN_INTERVAL_MS);
+            channel->m_wake_pending.store(false, std::memory_order_relaxed);
+            channel->flush();
+        }
+        return NULL;
+    }
+    // 每个缓冲区中的数据最多分成首尾两段，所有缓冲区攒够一批iovec才调用一次writev
+    // 写出之后才移动各缓冲区的tail，把空间还给写日志的线程
+    void drain(){
+        struct iovec iv[64];
+        size_t heads[MAX_THREADS];
+        int count = m_ring_count.load(std::memory_order_acquire);
+        unsigned long dropped = 0;
+        int n = 0;
+        int first = 0;
+        for(int i = 0; i < count; ++i){
+            ring* r = m_rings[i];
+            dropped += r->dropped.load(std::memory_order_relaxed);
+            size_t t = r->tail.load(std::memory_order_relaxed);
+            heads[i] = r->head.load(std::memory_order_acquire);
+            if(heads[i] == t){ continue; }
+            if(n + 2 > (int)(sizeof(iv) / sizeof(iv[0]))){
+                write_out(iv, n);
+                release(first, i, heads);
+                n = 0;
+                first = i;
+            }
+            size_t pos = t & (r->size - 1);
+            size_t len = heads[i] - t;
+            size_t part = (len < r->size - pos) ? len : r->size - pos;
+            iv[n].iov_base = r->buf + pos;
+            iv[n++].iov_len = part;
+            if(len > part){
+                iv[n].iov_base = r->buf;
+                iv[n++].iov_len = len - part;
+            }
+        }
+        write_out(iv, n);
+        release(first, count, heads);
+
+        // 有日志因缓冲区满而被丢弃时，告诉读日志的人
+        if(dropped != m_dropped){
+            char line[64];
+            struct iovec notice = { line, (size_t)snprintf(line, sizeof(line), "log: %lu lines dropped\n", dropped - m_dropped) };
+            m_dropped = dropped;
+            write_out(&notice, 1);
+        }
+    }
+
+    // 写出全部iovec，写出失败（如日志文件所在的磁盘满了）时放弃这一批
+    void write_out(struct iovec* iv, int n){
+        int idx = 0;
+        while(idx < n){
+            ssize_t ret = writev(m_fd, iv + idx, n - idx);
+            if(ret < 0){
+                if(errno == EINTR){ continue; }
+                return;
+            }
+            size_t sent = ret;
+            while(idx < n && sent >= iv[idx].iov_len){ sent -= iv[idx++].iov_len; }
+            if(idx < n){
+                iv[idx].iov_base = (char*)iv[idx].iov_base + sent;
+                iv[idx].iov_len -= sent;
+            }
+        }
+    }
+
+    void release(int from, int to, const size_t* heads){
+        for(int i = from; i < to; ++i){ m_rings[i]->tail.store(heads[i], std::memory_order_release); }
+    }
+
+    static void flush_all(){
+        for(int i = 0; i < s_count; ++i){ s_channels[i]->flush(); }
+    }
+
+    // fork时不能有别的线程拿着锁；子进程中只剩调用fork的线程，后台线程要重新创建，
+    // 从父进程继承来的还没写出的日志由父进程负责写出，子进程直接丢掉
+    static void before_fork(){
+        s_lock.lock();
+        for(int i = 0; i < s_count; ++i){
+            s_channels[i]->m_lock.lock();
+            s_channels[i]->m_drain_lock.lock();
+        }
+    }
+
+    static void after_fork_parent(){
+        for(int i = 0; i < s_count; ++i){
+            s_channels[i]->m_drain_lock.unlock();
+            s_channels[i]->m_lock.unlock();
+        }
+        s_lock.unlock();
+    }
+
+    static void after_fork_child(){
+        for(int i = 0; i < s_count; ++i){
+            log_channel* channel = s_channels[i];
+            int count = channel->m_ring_count.load(std::memory_order_relaxed);
+            for(int j = 0; j < count; ++j){
+                ring* r = channel->m_rings[j];
+                r->tail.store(r->head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+            channel->m_started.store(false, std::memory_order_relaxed);
+            channel->m_wake_pending.store(false, std::memory_order_relaxed);
+            channel->m_drain_lock.unlock();
+            channel->m_lock.unlock();
+        }
+        s_lock.unlock();
+    }
+
+    private:
+    int m_id;
+    int m_fd;
+    size_t m_ring_size;  // 每个线程的环形缓冲区大小
+    std::string m_path;  // open打开的文件，reopen时重新打开它
+    locker m_lock;       // 保护注册新的缓冲区和启动后台线程
+    locker m_drain_lock; // 后台线程和flush不能同时读缓冲区，也保护m_fd的替换
+    ring* m_rings[MAX_THREADS];
+    std::atomic<int> m_ring_count;
+    std::atomic<bool> m_started;
+    std::atomic<bool> m_reopen;
+    std::atomic<bool> m_wake_pending; // 已经post了m_wakeup，后台线程还没有醒来
+    sem m_wakeup;                     // 后台线程在此等待，超时或有缓冲区快满时醒来
+    unsigned long m_dropped; // 已经报告过的丢弃行数
+
+    static inline locker s_lock;
+    static inline log_channel* s_channels[MAX_CHANNELS];
+    static inline int s_count = 0;
+};
+
+// 诊断日志，默认写到标准输出
+class logger{
+    public:
+    static const int MAX_LINE = 1024; // 一行日志的最大长度，超过的部分被截掉
+
+    static logger* instance(){
+        static logger* log = new logger;
+        return log;
+    }
+
+    void set_fd(int fd){ m_channel->set_fd(fd); }
+
+    void log(int level, const char* format, ...) __attribute__((format(printf, 3, 4))){
+        char line[MAX_LINE];
+        int len = prefix(line, level, m_channel->thread_id());
+        va_list arg_list;
+        va_start(arg_list, format);
+        int ret = vsnprintf(line + len, MAX_LINE - len - 1, format, arg_list);
+        va_end(arg_list);
+        if(ret < 0){ return; }
+        len += (ret < MAX_LINE - len - 1) ? ret : MAX_LINE - len - 2;
+        if(line[len - 1] != '\n'){ line[len++] = '\n'; }
+        m_channel->append(line, len);
+    }
+
+    void flush(){ m_channel->flush(); }
+
+    private:
+    logger(): m_channel(new log_channel(STDOUT_FILENO)){}
+
+    // "2023-10-20 08:00:00.123456 INFO  [3] "，同一秒内的日期部分只格式化一次
+    int prefix(char* line, int level, int id){
+        static const char* names[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+        static thread_local time_t last_sec = -1;
+        static thread_local char date[32];
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        if(ts.tv_sec != last_sec){
+            struct tm tm;
+            localtime_r(&ts.tv_sec, &tm);
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+            last_sec = ts.tv_sec;
+        }
+        return snprintf(line, MAX_LINE, "%s.%06ld %s [%d] ", date, ts.tv_nsec / 1000, names[level], id);
+    }
+
+    private:
+    log_channel* m_channel;
+};
+
+#endif
@@ -3,6 +3,9 @@
 #define LST_TIMER
 
 #include<time.h>
+
+#include "log.h"
+
 #define BUFFER_SIZE 64
 class util_timer;
 
@@ -125,7 +128,7 @@ class sort_timer_lst{
     // SIGALRM信号每次触发就在其信号处理函数（如果使用统一事件源，则是主函数）中执行一次tick函数，以处理链表上到期的任务
     void tick(){
         if(!head){ return; }
-        printf("timer tick\n");
+        LOG_DEBUG("timer tick");
         time_t cur = time(NULL); // 获得系统当前的时间
         util_timer* tmp = head;
 
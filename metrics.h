@@ -0,0 +1,202 @@
+// 运行指标
+// 每个线程只写自己的一份分片，计数器用relaxed的load和store累加，不需要加锁，也没有原子读改写操作；
+// 导出时把所有分片加起来，结果不是某一瞬间的精确快照，但每个计数都不会丢
+// 延迟直方图采用HDR的对数线性分桶：每个2的幂区间再等分成8个桶，在任何量级上的相对误差都不超过12.5%
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <time.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+
+#include "locker.h"
+
+// 记录的各段延迟
+enum METRIC_HISTOGRAM
+{
+    HISTOGRAM_QUEUE_WAIT = 0, // 请求在线程池队列中等待的时间
+    HISTOGRAM_PARSE,          // 解析请求（含路由和查找目标文件）的时间
+    HISTOGRAM_FIRST_BYTE,     // 从读入请求到发出应答的第一个字节
+    HISTOGRAM_TOTAL,          // 从读入请求到应答全部发出
+    HISTOGRAM_COUNT
+};
+
+class latency_histogram{
+    public:
+    static const int SUB_BITS = 3;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAX_EXPONENT = 39; // 超过2^40微秒（约12天）的值都记在最后一个桶里
+    static const int BUCKETS = (MAX_EXPONENT - SUB_BITS + 2) * SUB_BUCKETS;
+
+    // 小于16的值每个值一个桶，之后每个2的幂区间8个桶
+    static int index_of(unsigned long long value){
+        if(value < 2 * SUB_BUCKETS){ return value; }
+        int exponent = 63 - __builtin_clzll(value);
+        if(exponent > MAX_EXPONENT){ return BUCKETS - 1; }
+        return (exponent - SUB_BITS + 1) * SUB_BUCKETS + ((value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1));
+    }
+
+    // 第index个桶中的最大值
+    static unsigned long long upper_of(int index){
+        if(index < 2 * SUB_BUCKETS){ return index; }
+        int exponent = index / SUB_BUCKETS + SUB_BITS - 1;
+        unsigned long long sub = index % SUB_BUCKETS + SUB_BUCKETS;
+        return ((sub + 1) << (exponent - SUB_BITS)) - 1;
+    }
+
+    latency_histogram(){
+        for(int i = 0; i < BUCKETS; ++i){ m_counts[i].store(0, std::memory_order_relaxed); }
+        m_sum.store(0, std::memory_order_relaxed);
+    }
+
+    // 只能由拥有这个直方图的线程调用
+    void add(unsigned long long value){
+        std::atomic<unsigned long>& count = m_counts[index_of(value)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        m_sum.store(m_sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    // 把计数加到counts和sum上，可以在任何线程中调用
+    void merge_into(unsigned long* counts, unsigned long long* sum) const {
+        for(int i = 0; i < BUCKETS; ++i){ counts[i] += m_counts[i].load(std::memory_order_relaxed); }
+        *sum += m_sum.load(std::memory_order_relaxed);
+    }
+
+    private:
+    std::atomic<unsigned long> m_counts[BUCKETS];
+    std::atomic<unsigned long long> m_sum;
+};
+
+class metrics{
+    public:
+    static const int MAX_THREADS = 256; // 更多的线程的数据不被记录
+    static const int MAX_CODES = 16;    // 按处理结果分类的计数器个数
+
+    static metrics* instance(){
+        static metrics* m = new metrics; // 分片在线程退出后仍可能被导出，所以从不销毁
+        return m;
+    }
+
+    // 单调时钟的当前时刻，微秒
+    static long long now_us(){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    }
+
+    void observe(METRIC_HISTOGRAM which, long long us){
+        shard* s = local_shard();
+        if(s){ s->histograms[which].add(us > 0 ? us : 0); }
+    }
+
+    // 一个应答已经结束，code是它的处理结果，bytes是实际发出的字节数
+    void count_response(int code, long bytes){
+        shard* s = local_shard();
+        if(!s || code < 0 || code >= MAX_CODES){ return; }
+        add(s->responses[code], 1);
+        add(s->bytes, bytes);
+    }
+
+    // 各线程的计数之和
+    unsigned long long responses(int code) const {
+        unsigned long long total = 0;
+        int count = m_shard_count.load(std::memory_order_acquire);
+        for(int i = 0; i < count; ++i){ total += m_shards[i]->responses[code].load(std::memory_order_relaxed); }
+        return total;
+    }
+
+    unsigned long long bytes() const {
+        unsigned long long total = 0;
+        int count = m_shard_count.load(std::memory_order_acquire);
+        for(int i = 0; i < count; ++i){ total += m_shards[i]->bytes.load(std::memory_order_relaxed); }
+        return total;
+    }
+
+    // 以Prometheus文本格式输出一个直方图，另外用name_quantile输出由细分的桶估计出的分位数
+    // 每个2的幂取它之前的最后一个细分桶，le就是这个桶的上界(2^e - 1)微秒；记录的值都是整数微秒，所以每个le的计数都是精确的
+    void render_histogram(std::string* out, METRIC_HISTOGRAM which, const char* name, const char* help) const {
+        static unsigned long counts[latency_histogram::BUCKETS];
+        static locker lock; // counts较大，不放在栈上
+        lock.lock();
+        unsigned long long sum = 0;
+        for(int i = 0; i < latency_histogram::BUCKETS; ++i){ counts[i] = 0; }
+        int count = m_shard_count.load(std::memory_order_acquire);
+        for(int i = 0; i < count; ++i){ m_shards[i]->histograms[which].merge_into(counts, &sum); }
+
+        char line[256];
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+        out->append(line);
+        unsigned long total = 0;
+        int index = 0;
+        for(int exponent = 0; exponent <= 26; ++exponent){
+            int end = latency_histogram::index_of(1ULL << exponent);
+            for(; index < end; ++index){ total += counts[index]; }
+            snprintf(line, sizeof(line), "%s_bucket{le=\"%.6f\"} %lu\n", name,
+                latency_histogram::upper_of(end - 1) / 1e6, total);
+            out->append(line);
+        }
+        for(; index < latency_histogram::BUCKETS; ++index){ total += counts[index]; }
+        snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.6f\n%s_count %lu\n", name, total, name,
+            sum / 1e6, name, total);
+        out->append(line);
+
+        static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+        snprintf(line, sizeof(line), "# TYPE %s_quantile gauge\n", name);
+        out->append(line);
+        for(unsigned q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); ++q){
+            unsigned long rank = (unsigned long)(quantiles[q] * total + 0.5);
+            unsigned long seen = 0;
+            int i = 0;
+            for(; i < latency_histogram::BUCKETS - 1; ++i){
+                seen += counts[i];
+                if(seen >= rank && seen > 0){ break; }
+            }
+            double value = total ? latency_histogram::upper_of(i) / 1e6 : 0;
+            snprintf(line, sizeof(line), "%s_quantile{quantile=\"%g\"} %.6f\n", name, quantiles[q], value);
+            out->append(line);
+        }
+        lock.unlock();
+    }
+
+    private:
+    // 每个线程一份，按缓存行对齐，不同线程的计数不会落在同一缓存行上
+    struct alignas(64) shard{
+        shard(): bytes(0){
+            for(int i = 0; i < MAX_CODES; ++i){ responses[i].store(0, std::memory_order_relaxed); }
+        }
+        latency_histogram histograms[HISTOGRAM_COUNT];
+        std::atomic<unsigned long long> responses[MAX_CODES];
+        std::atomic<unsigned long long> bytes;
+    };
+
+    metrics(): m_shard_count(0){}
+
+    static void add(std::atomic<unsigned long long>& counter, unsigned long long value){
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    // 调用线程的分片，第一次记录时创建
+    shard* local_shard(){
+        static thread_local shard* local = 0;
+        static thread_local bool full = false;
+        if(local || full){ return local; }
+        m_lock.lock();
+        int count = m_shard_count.load(std::memory_order_relaxed);
+        if(count < MAX_THREADS){
+            local = new shard;
+            m_shards[count] = local;
+            m_shard_count.store(count + 1, std::memory_order_release);
+        }
+        m_lock.unlock();
+        full = !local;
+        return local;
+    }
+
+    private:
+    locker m_lock; // 保护注册新的分片
+    shard* m_shards[MAX_THREADS];
+    std::atomic<int> m_shard_count;
+};
+
+#endif
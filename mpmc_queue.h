@@ -0,0 +1,149 @@
+// 有界的多生产者多消费者无锁队列（Dmitry Vyukov的算法）
+// 环形数组的每个槽位带一个序号：序号等于入队位置时槽位空闲，等于入队位置加一时数据已经写好
+// 生产者和消费者分别用CAS抢占入队位置和出队位置，抢到之后只读写自己的槽位，写完再用序号发布
+// 全程不加锁，也不为每个元素分配内存；两个位置各占一个缓存行，生产者和消费者不会互相使对方的缓存行失效
+// 成批入队出队时先确认连续的若干个槽位都可用，再用一次CAS把位置一起推进，一批只争抢一次
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+
+template <typename T>
+class mpmc_queue{
+    public:
+    // 容量向上取到2的幂
+    explicit mpmc_queue(size_t capacity){
+        size_t size = 2;
+        while(size < capacity){ size <<= 1; }
+        m_buffer = new cell[size];
+        m_mask = size - 1;
+        for(size_t i = 0; i < size; ++i){ m_buffer[i].sequence.store(i, std::memory_order_relaxed); }
+        m_enqueue_pos.store(0, std::memory_order_relaxed);
+        m_dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    ~mpmc_queue(){ delete[] m_buffer; }
+
+    // 队列满时返回false
+    bool push(const T& value){
+        cell* c;
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        while(true){
+            c = &m_buffer[pos & m_mask];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            long diff = (long)seq - (long)pos;
+            if(diff == 0){
+                if(m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){ break; }
+            }
+            else if(diff < 0){ return false; } // 槽位中还是上一圈没有取走的数据
+            else{ pos = m_enqueue_pos.load(std::memory_order_relaxed); }
+        }
+        c->data = value;
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 队列空时返回false
+    // 另一个生产者抢到了更早的位置但还没有写完时也返回false，即使后面的位置已经有数据
+    bool pop(T* value){
+        cell* c;
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        while(true){
+            c = &m_buffer[pos & m_mask];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            long diff = (long)seq - (long)(pos + 1);
+            if(diff == 0){
+                if(m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){ break; }
+            }
+            else if(diff < 0){ return false; }
+            else{ pos = m_dequeue_pos.load(std::memory_order_relaxed); }
+        }
+        *value = c->data;
+        c->sequence.store(pos + m_mask + 1, std::memory_order_release); // 下一圈同一位置的生产者可以写了
+        return true;
+    }
+
+    // 把values中的前若干个元素放入队列，返回放入的个数，队列满时返回0
+    // 只放入从当前入队位置起连续空闲的槽位，所以可能少于n个，调用者可以接着放剩下的
+    size_t push_batch(const T* values, size_t n){
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        size_t count;
+        while(true){
+            count = 0;
+            while(count < n && count <= m_mask){
+                size_t seq = m_buffer[(pos + count) & m_mask].sequence.load(std::memory_order_acquire);
+                if(seq != pos + count){ break; }
+                ++count;
+            }
+            if(count == 0){
+                long diff = (long)m_buffer[pos & m_mask].sequence.load(std::memory_order_relaxed) - (long)pos;
+                if(diff < 0){ return 0; }
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+                continue;
+            }
+            // 位置没有被别人推进过，这count个槽位就都归自己了
+            if(m_enqueue_pos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)){ break; }
+        }
+        for(size_t i = 0; i < count; ++i){
+            cell& c = m_buffer[(pos + i) & m_mask];
+            c.data = values[i];
+            c.sequence.store(pos + i + 1, std::memory_order_release);
+        }
+        return count;
+    }
+
+    // 最多取出n个元素，返回取出的个数，队列空时返回0
+    // 与pop一样，只取从当前出队位置起连续写好的元素
+    size_t pop_batch(T* values, size_t n){
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        size_t count;
+        while(true){
+            count = 0;
+            while(count < n && count <= m_mask){
+                size_t seq = m_buffer[(pos + count) & m_mask].sequence.load(std::memory_order_acquire);
+                if(seq != pos + count + 1){ break; }
+                ++count;
+            }
+            if(count == 0){
+                long diff = (long)m_buffer[pos & m_mask].sequence.load(std::memory_order_relaxed) - (long)(pos + 1);
+                if(diff < 0){ return 0; }
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+                continue;
+            }
+            if(m_dequeue_pos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)){ break; }
+        }
+        for(size_t i = 0; i < count; ++i){
+            cell& c = m_buffer[(pos + i) & m_mask];
+            values[i] = c.data;
+            c.sequence.store(pos + i + m_mask + 1, std::memory_order_release);
+        }
+        return count;
+    }
+
+    // 近似的元素个数，其它线程同时在入队出队时只能作为参考
+    size_t size_approx() const {
+        size_t enqueue = m_enqueue_pos.load(std::memory_order_relaxed);
+        size_t dequeue = m_dequeue_pos.load(std::memory_order_relaxed);
+        return enqueue > dequeue ? enqueue - dequeue : 0;
+    }
+
+    size_t capacity() const { return m_mask + 1; }
+
+    private:
+    mpmc_queue(const mpmc_queue&);
+    mpmc_queue& operator=(const mpmc_queue&);
+
+    struct cell{
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    cell* m_buffer;
+    size_t m_mask;
+    alignas(64) std::atomic<size_t> m_enqueue_pos;
+    alignas(64) std::atomic<size_t> m_dequeue_pos;
+    char m_pad[64 - sizeof(std::atomic<size_t>)]; // 不和紧随其后的对象共用缓存行
+};
+
+#endif
@@ -18,6 +18,8 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 
+#include "log.h"
+
 // 描述一个子进程的类
 // m_pid是目标子进程的PID
 // m_pipefd是父进程和子进程通信用的管道
@@ -230,7 +232,7 @@ void processpool<T>::run_child()
         number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, -1);
         if ((number < 0) && (errno != EINTR))
         {
-            printf("epoll failure\n");
+            LOG_ERROR("epoll failure");
             break;
         }
 
@@ -257,7 +259,7 @@ void processpool<T>::run_child()
                     int connfd = accept(m_listenfd, (struct sockaddr *)&client_address, &client_addrlength);
                     if (connfd < 0)
                     {
-                        printf("errno is: %d\n", errno);
+                        LOG_WARN("accept failed, errno is: %d", errno);
                         continue;
                     }
                     addfd(m_epollfd, connfd);
@@ -348,7 +350,7 @@ void processpool<T>::run_parent()
         number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, -1);
         if ((number < 0) && (errno != EINTR))
         {
-            printf("epoll failure\n");
+            LOG_ERROR("epoll failure");
             break;
         }
 
@@ -366,7 +368,7 @@ void processpool<T>::run_parent()
                         break;
                     }                               // 轮询找到第一个能用的子进程
                     i = (i + 1) % m_process_number; // 不能用的话按顺序往后遍历
-                } while (i != sub_process_counter)
+                } while (i != sub_process_counter);
 
                 // 这个意思说，只要轮询到的子进程结束了，父进程就要罢工？
                 // 2023-10-20，这个意思是说没有轮询到还在运行的子进程，父进程就可以停止了
@@ -383,7 +385,7 @@ void processpool<T>::run_parent()
                 // new_conn没啥意义，就是一个消息而已，子进程收到这个消息后会调用accept函数
                 // 因为父子进程m_listenfd是共享的
                 send(m_sub_process[i].m_pipefd[0], (char *)&new_conn, sizeof(new_conn), 0);
-                printf("send request to child %d\n", i);
+                LOG_DEBUG("send request to child %d", i);
             }
             else if ((sockfd == sig_pipefd[0]) && (events[i].events & EPOLLIN))
             {
@@ -413,7 +415,7 @@ void processpool<T>::run_parent()
                                     // 并设置相应的m_pid为-1，以标记该子进程已经退出
                                     if (m_sub_process[i].m_pid == pid)
                                     {
-                                        printf("child %d join\n", i);
+                                        LOG_INFO("child %d join", i);
                                         close(m_sub_process[i].m_pipefd[0]);
                                         m_sub_process[i].m_pid = -1;
                                     }
@@ -436,7 +438,7 @@ void processpool<T>::run_parent()
                             // 如果父进程接收到终止信号，那么就杀死所有子进程
                             // 并等待它们全部结束
                             // 当然，通知子进程结束更好的方法是向父、子进程之间的通信管道发送特殊数据，读者不放自己实现之
-                            printf("kill all the child now\n");
+                            LOG_INFO("kill all the child now");
                             for (int i = 0; i < m_process_number; ++i)
                             {
                                 int pid = m_sub_process[i].m_pid;
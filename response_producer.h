@@ -0,0 +1,43 @@
+// 动态生成的应答内容
+// 长度事先未知的内容不再整个生成到写缓冲区里再算Content-Length，而是用分块编码边生成边发送：
+// socket可写时http_conn::write调用produce把写缓冲区填满，作为一个分块发出，发不动时等下一次EPOLLOUT再继续
+// 所以无论内容多大，每个连接占用的内存都不超过一个分块，客户也能更早收到第一个字节
+#ifndef RESPONSE_PRODUCER_H
+#define RESPONSE_PRODUCER_H
+
+#include <string.h>
+#include <string>
+
+class response_producer{
+    public:
+    virtual ~response_producer(){}
+    // 应答的Content-Type
+    virtual const char* content_type() const = 0;
+    // 把接下来的内容写入buf，最多size字节，返回写入的字节数；返回0表示内容已经全部生成，返回-1表示出错
+    // 一个分块中的数据可能来自多次调用，每次只写一小段也不会多出报文段
+    // 它在主线程的write中被调用，不能阻塞；出错时应答头部已经发出，只能直接关闭连接，客户因收不到最后的空分块而知道内容不完整
+    virtual long produce(char* buf, size_t size) = 0;
+};
+
+// 已经在内存中生成好的内容，如拼好的JSON，同样以分块发送，处理者不必计算长度
+class string_producer : public response_producer{
+    public:
+    string_producer(const std::string& content, const char* type): m_content(content), m_type(type), m_pos(0){}
+
+    const char* content_type() const { return m_type; }
+
+    long produce(char* buf, size_t size){
+        size_t len = m_content.size() - m_pos;
+        if(len > size){ len = size; }
+        memcpy(buf, m_content.data() + m_pos, len);
+        m_pos += len;
+        return len;
+    }
+
+    private:
+    std::string m_content;
+    const char* m_type;
+    size_t m_pos;
+};
+
+#endif
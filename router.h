@@ -0,0 +1,317 @@
+// 请求路由
+// 启动时注册url模式和对应的request_handler，然后compile成一棵按路径段划分的压平的前缀树，
+// 处理请求时从根开始逐段二分查找子节点，代价只与url的段数有关，与注册了多少路由无关
+// 静态文件也只是一种request_handler，http_conn不再把url直接拼到网站根目录上
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "body_handler.h"
+#include "response_producer.h"
+#include "header_table.h"
+
+class request_handler;
+
+struct route_param{
+    const char* name;  // 模式中':'之后的参数名
+    const char* value; // url中对应的路径段，不以'\0'结尾
+    size_t len;
+};
+
+// 路由匹配的结果，其中的指针都指向url和路由表，只在处理这个请求期间有效
+struct route_match{
+    static const int MAX_PARAMS = 8;
+
+    request_handler* handler;
+    const char* url;
+    const char* rest; // 前缀路由中前缀之后的部分（不含开头的'/'），其它路由为url的结尾
+    const header_table* headers; // 请求的全部头部
+    int param_count;
+    route_param params[MAX_PARAMS];
+
+    // 按名字取参数值，没有这个参数时返回false
+    bool param(const char* name, std::string* value) const {
+        for(int i = 0; i < param_count; ++i){
+            if(strcmp(params[i].name, name) == 0){
+                value->assign(params[i].value, params[i].len);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// 处理某一类url的请求，由工作线程并发调用，不能修改自身的状态
+// 三个函数都有默认实现，处理者只需覆盖它支持的那部分
+class request_handler{
+    public:
+    virtual ~request_handler(){}
+    // GET和HEAD请求：返回生成应答内容的response_producer，返回NULL则由file_path决定回复哪个文件
+    virtual response_producer* on_get(const route_match& /*match*/){ return NULL; }
+    // GET和HEAD请求：把要回复的文件的完整路径写入path（最多size字节，含结尾的'\0'），返回false表示没有对应的文件，回复404
+    virtual bool file_path(const route_match& /*match*/, char* /*path*/, int /*size*/){ return false; }
+    // POST请求：返回处理消息体的body_handler，content_length为-1表示消息体采用分块编码
+    // 返回NULL表示不接受这个请求，消息体会被读完丢弃，然后回复405
+    virtual body_handler* on_post(const route_match& /*match*/, long /*content_length*/){ return NULL; }
+};
+
+inline int hex_value(char c){
+    if(c >= '0' && c <= '9'){ return c - '0'; }
+    c |= 0x20;
+    if(c >= 'a' && c <= 'f'){ return c - 'a' + 10; }
+    return -1;
+}
+
+// 把url中的路径[src, src + len)一遍解码并规范化到dst中，结果以'/'开头、以'\0'结尾，返回不含'\0'的长度
+// 边解码%XX边按'/'切分路径段：连续的'/'合并为一个，"."段被去掉，".."段连同它前面的一段一起去掉，
+// 所以结果中没有"."和".."段，拼到网站根目录之后不会跑到根目录之外；以'/'、"."或".."结尾的路径结果以'/'结尾
+// ".."退到根之上、%XX格式错误、解码出'\0'或者放不进size字节时返回-1
+inline int normalize_path(const char* src, size_t len, char* dst, int size){
+    if(size < 2){ return -1; }
+    int out = 0;
+    dst[out++] = '/';
+    int segment = out; // 当前路径段在dst中的起始位置
+    for(size_t i = 0; i <= len; ++i){
+        char c = '/'; // 在结尾处补一个'/'以结束最后一段
+        if(i < len){
+            c = src[i];
+            if(c == '%'){
+                int high = (i + 2 < len) ? hex_value(src[i + 1]) : -1;
+                int low = (high >= 0) ? hex_value(src[i + 2]) : -1;
+                if(low < 0 || (high == 0 && low == 0)){ return -1; }
+                c = high * 16 + low;
+                i += 2;
+            }
+        }
+        if(c != '/'){
+            if(out >= size - 1){ return -1; }
+            dst[out++] = c;
+            continue;
+        }
+        int segment_len = out - segment;
+        if(segment_len == 1 && dst[segment] == '.'){ out = segment; }
+        else if(segment_len == 2 && dst[segment] == '.' && dst[segment + 1] == '.'){
+            if(segment == 1){ return -1; }
+            out = segment - 1;
+            while(dst[out - 1] != '/'){ --out; }
+            segment = out;
+        }
+        else if(segment_len > 0 && i < len){
+            if(out >= size - 1){ return -1; }
+            dst[out++] = '/';
+            segment = out;
+        }
+    }
+    dst[out] = '\0';
+    return out;
+}
+
+// 把url映射到root目录下的文件，查询串不参与映射
+class static_file_handler : public request_handler{
+    public:
+    explicit static_file_handler(const char* root): m_root(root), m_root_len(strlen(root)){}
+
+    // 网站根目录之后接上解码并规范化的url，url不合法或者路径太长时返回false
+    bool file_path(const route_match& match, char* path, int size){
+        if(m_root_len >= size){ return false; }
+        memcpy(path, m_root, m_root_len);
+        return normalize_path(match.rest, strcspn(match.rest, "?"), path + m_root_len, size - m_root_len) >= 0;
+    }
+
+    private:
+    const char* m_root;
+    int m_root_len;
+};
+
+// 支持三种模式，按路径段匹配，url中'?'之后的查询串不参与匹配：
+// 精确路由，如"/api/status"，"/"只匹配网站根；
+// 参数路由，如"/api/users/:id"，":id"匹配任意一个非空的路径段；
+// 前缀路由，以"/*"结尾，如"/static/*"，匹配"/static"本身及其下所有url，"/*"匹配所有url
+// 同一位置上固定的路径段优先于参数，两者都不能匹配时回退到沿途最长的前缀路由
+// router不拥有request_handler，它们的生命期应长于router
+class router{
+    public:
+    router(){ m_building.push_back(build_node()); }
+
+    // 注册路由，模式格式错误或与已有路由重复时返回false
+    // 必须在compile之前、启动阶段调用
+    bool add(const char* pattern, request_handler* handler){
+        if(pattern[0] != '/' || !handler){ return false; }
+        int n = 0;
+        const char* p = pattern + 1;
+        while(true){
+            const char* end = strchr(p, '/');
+            if(!end){ end = p + strlen(p); }
+            std::string segment(p, end);
+            if(segment == "*"){
+                if(*end != '\0' || m_building[n].prefix){ return false; }
+                m_building[n].prefix = handler;
+                return true;
+            }
+            if(segment[0] == ':'){
+                if(segment.size() == 1){ return false; }
+                if(m_building[n].param < 0){
+                    int child = m_building.size();
+                    m_building.push_back(build_node());
+                    m_building[n].param = child;
+                    m_building[n].param_name = segment.substr(1);
+                }
+                else if(m_building[n].param_name != segment.substr(1)){ return false; }
+                n = m_building[n].param;
+            }
+            else{
+                std::map<std::string, int>::iterator it = m_building[n].children.find(segment);
+                if(it == m_building[n].children.end()){
+                    int child = m_building.size();
+                    m_building.push_back(build_node());
+                    m_building[n].children[segment] = child;
+                    n = child;
+                }
+                else{ n = it->second; }
+            }
+            if(*end == '\0'){ break; }
+            p = end + 1;
+        }
+        if(m_building[n].exact){ return false; }
+        m_building[n].exact = handler;
+        return true;
+    }
+
+    // 把注册好的路由压平：每个节点的固定子节点连续存放并按路径段排序，路径段的内容集中在一块内存中
+    void compile(){
+        m_nodes.clear();
+        m_names.clear();
+        m_nodes.push_back(node());
+        flatten(0, 0);
+    }
+
+    bool compiled() const { return !m_nodes.empty(); }
+
+    // 查找url对应的处理者，没有匹配的路由时返回false
+    bool match(const char* url, route_match* result) const {
+        if(url[0] != '/' || m_nodes.empty()){ return false; }
+        result->handler = 0;
+        result->url = url;
+        result->headers = 0;
+        result->param_count = 0;
+        const char* end = url + strcspn(url, "?");
+        return match_node(0, url + 1, end, result);
+    }
+
+    private:
+    struct build_node{
+        build_node(): param(-1), exact(0), prefix(0){}
+        std::map<std::string, int> children;
+        int param;
+        std::string param_name;
+        request_handler* exact;
+        request_handler* prefix;
+    };
+
+    struct node{
+        node(): segment(0), segment_len(0), first_child(0), child_count(0), param(-1), param_name(0), exact(0), prefix(0){}
+        int segment;       // 本节点的路径段在m_names中的位置
+        int segment_len;
+        int first_child;   // 固定子节点在m_nodes中的起始位置
+        int child_count;
+        int param;         // 参数子节点，没有为-1
+        int param_name;    // 参数名在m_names中的位置
+        request_handler* exact;
+        request_handler* prefix;
+    };
+
+    // 把第from个构建节点的子树复制到第to个节点之下
+    void flatten(int from, int to){
+        const build_node& b = m_building[from];
+        m_nodes[to].exact = b.exact;
+        m_nodes[to].prefix = b.prefix;
+        m_nodes[to].first_child = m_nodes.size();
+        m_nodes[to].child_count = b.children.size();
+        // std::map按路径段的字典序遍历，与lookup中memcmp的顺序一致
+        for(std::map<std::string, int>::const_iterator it = b.children.begin(); it != b.children.end(); ++it){
+            node child;
+            child.segment = m_names.size();
+            child.segment_len = it->first.size();
+            m_names.append(it->first);
+            m_names.push_back('\0');
+            m_nodes.push_back(child);
+        }
+        if(b.param >= 0){
+            m_nodes[to].param = m_nodes.size();
+            m_nodes[to].param_name = m_names.size();
+            m_names.append(b.param_name);
+            m_names.push_back('\0');
+            m_nodes.push_back(node());
+        }
+        int first = m_nodes[to].first_child;
+        int i = 0;
+        for(std::map<std::string, int>::const_iterator it = b.children.begin(); it != b.children.end(); ++it, ++i){
+            flatten(it->second, first + i);
+        }
+        if(b.param >= 0){ flatten(b.param, m_nodes[to].param); }
+    }
+
+    // 在第n个节点的固定子节点中二分查找路径段[p, p + len)
+    int lookup(int n, const char* p, int len) const {
+        int low = m_nodes[n].first_child;
+        int high = low + m_nodes[n].child_count - 1;
+        while(low <= high){
+            int mid = (low + high) / 2;
+            const node& child = m_nodes[mid];
+            int common = (child.segment_len < len) ? child.segment_len : len;
+            int cmp = memcmp(m_names.data() + child.segment, p, common);
+            if(cmp == 0){ cmp = child.segment_len - len; }
+            if(cmp == 0){ return mid; }
+            if(cmp < 0){ low = mid + 1; }
+            else{ high = mid - 1; }
+        }
+        return -1;
+    }
+
+    // p是第n个节点之后的下一个路径段的开头，end是url中路径的结尾
+    bool match_node(int n, const char* p, const char* end, route_match* result) const {
+        const char* segment_end = (const char*)memchr(p, '/', end - p);
+        if(!segment_end){ segment_end = end; }
+
+        int child = lookup(n, p, segment_end - p);
+        if(child >= 0 && descend(child, segment_end, end, result)){ return true; }
+
+        int param = m_nodes[n].param;
+        if(param >= 0 && segment_end > p && result->param_count < route_match::MAX_PARAMS){
+            route_param& value = result->params[result->param_count++];
+            value.name = m_names.data() + m_nodes[n].param_name;
+            value.value = p;
+            value.len = segment_end - p;
+            if(descend(param, segment_end, end, result)){ return true; }
+            --result->param_count;
+        }
+
+        if(m_nodes[n].prefix){
+            result->handler = m_nodes[n].prefix;
+            result->rest = p;
+            return true;
+        }
+        return false;
+    }
+
+    // 第n个节点已经匹配了url中以p结尾的路径段
+    bool descend(int n, const char* p, const char* end, route_match* result) const {
+        if(p < end){ return match_node(n, p + 1, end, result); }
+        request_handler* handler = m_nodes[n].exact ? m_nodes[n].exact : m_nodes[n].prefix;
+        if(!handler){ return false; }
+        result->handler = handler;
+        result->rest = p;
+        return true;
+    }
+
+    private:
+    std::vector<build_node> m_building; // add构建的树，compile时压平
+    std::vector<node> m_nodes;          // 第0个是根节点
+    std::string m_names;                // 所有路径段和参数名，各以'\0'结尾
+};
+
+#endif
@@ -0,0 +1,191 @@
+// 文件状态缓存
+// 以规范化之后的完整路径为键缓存stat的结果，包括文件不存在这样的否定结果，重复请求同一个路径时不再调用stat
+// 缓存项不靠过期时间校验，而是用inotify监视它所在的目录：目录中的某一项被创建、删除、改名、写入或修改属性时，
+// 后台线程立即把对应的缓存项作废；inotify事件队列溢出或被监视的目录本身消失时整个缓存作废
+// 哈希表分成若干个分片，各有一把锁，不同路径的查找很少争用同一把锁
+// inotify不可用（如超过了max_user_watches）的目录下的路径不缓存，每次都调用stat
+// 只监视路径的直接上级目录，更上层的目录被改名时察觉不到
+#ifndef STAT_CACHE_H
+#define STAT_CACHE_H
+
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <string>
+#include <functional>
+#include <unordered_map>
+
+#include "locker.h"
+#include "log.h"
+
+class stat_cache{
+    public:
+    static const int SHARDS = 16;                 // 分片数
+    static const size_t MAX_SHARD_ENTRIES = 4096; // 每个分片最多缓存的路径数，满了就清空这个分片
+
+    static stat_cache* instance(){
+        static stat_cache* cache = new stat_cache; // 后台线程一直在运行，所以从不销毁
+        return cache;
+    }
+
+    // 与stat相同：成功时返回0并填好st，失败时返回-1并设置errno
+    int stat(const char* path, struct stat* st){
+        std::string key(path);
+        shard& s = m_shards[std::hash<std::string>()(key) % SHARDS];
+        s.lock.lock();
+        std::unordered_map<std::string, entry>::iterator it = s.entries.find(key);
+        if(it != s.entries.end()){
+            entry e = it->second;
+            s.lock.unlock();
+            return result(e, st);
+        }
+        unsigned long generation = s.generation;
+        s.lock.unlock();
+
+        // 先监视目录再stat，这样stat之后发生的修改一定能收到事件
+        bool watched = watch(key);
+        entry e;
+        e.err = (::stat(path, &e.st) < 0) ? errno : 0;
+        if(watched){
+            s.lock.lock();
+            // 在stat期间这个分片有缓存项被作废过，刚得到的结果可能已经过时，不放进缓存
+            if(s.generation == generation){
+                if(s.entries.size() >= MAX_SHARD_ENTRIES){ s.entries.clear(); }
+                s.entries[key] = e;
+            }
+            s.lock.unlock();
+        }
+        return result(e, st);
+    }
+
+    private:
+    struct entry{
+        struct stat st;
+        int err; // stat失败时的errno，成功为0
+    };
+
+    struct alignas(64) shard{
+        shard(): generation(0){}
+        locker lock;
+        std::unordered_map<std::string, entry> entries;
+        unsigned long generation; // 每作废一次缓存项加一
+    };
+
+    stat_cache(){
+        m_fd = inotify_init1(IN_CLOEXEC);
+        if(m_fd < 0){
+            LOG_WARN("inotify_init1 failed, errno is: %d, stat results will not be cached", errno);
+            return;
+        }
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, watcher, this) != 0){
+            close(m_fd);
+            m_fd = -1;
+            return;
+        }
+        pthread_detach(tid);
+    }
+
+    static int result(const entry& e, struct stat* st){
+        if(e.err){
+            errno = e.err;
+            return -1;
+        }
+        *st = e.st;
+        return 0;
+    }
+
+    // 确保path所在的目录已被监视，不能监视时返回false
+    bool watch(const std::string& path){
+        if(m_fd < 0){ return false; }
+        size_t slash = path.rfind('/');
+        if(slash == std::string::npos){ return false; }
+        std::string dir = (slash == 0) ? std::string("/") : path.substr(0, slash);
+        m_watch_lock.lock();
+        bool ok = m_watched.count(dir) > 0;
+        if(!ok){
+            int wd = inotify_add_watch(m_fd, dir.c_str(), IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE
+                | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+            if(wd >= 0){
+                m_watched[dir] = wd;
+                m_dirs[wd] = dir;
+                ok = true;
+            }
+        }
+        m_watch_lock.unlock();
+        return ok;
+    }
+
+    void invalidate(const std::string& path){
+        shard& s = m_shards[std::hash<std::string>()(path) % SHARDS];
+        s.lock.lock();
+        s.entries.erase(path);
+        ++s.generation;
+        s.lock.unlock();
+    }
+
+    void invalidate_all(){
+        for(int i = 0; i < SHARDS; ++i){
+            m_shards[i].lock.lock();
+            m_shards[i].entries.clear();
+            ++m_shards[i].generation;
+            m_shards[i].lock.unlock();
+        }
+    }
+
+    static void* watcher(void* arg){
+        ((stat_cache*)arg)->run();
+        return NULL;
+    }
+
+    // 后台线程：阻塞读取inotify事件，把事件中的目录和文件名拼成路径，作废对应的缓存项
+    void run(){
+        alignas(struct inotify_event) char buf[16 * 1024];
+        while(true){
+            ssize_t len = read(m_fd, buf, sizeof(buf));
+            if(len < 0){
+                if(errno == EINTR){ continue; }
+                LOG_ERROR("inotify read failed, errno is: %d", errno);
+                return;
+            }
+            for(char* p = buf; p < buf + len; ){
+                struct inotify_event* event = (struct inotify_event*)p;
+                p += sizeof(struct inotify_event) + event->len;
+                if(event->mask & IN_Q_OVERFLOW){
+                    invalidate_all();
+                    continue;
+                }
+                m_watch_lock.lock();
+                std::unordered_map<int, std::string>::iterator it = m_dirs.find(event->wd);
+                std::string dir = (it != m_dirs.end()) ? it->second : std::string();
+                // 目录本身被删除后监视自动解除，改名后监视会跟到新的名字上，所以主动解除，其下的路径要重新监视
+                if(!dir.empty() && (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))){
+                    if(event->mask & IN_MOVE_SELF){ inotify_rm_watch(m_fd, event->wd); }
+                    m_watched.erase(dir);
+                    m_dirs.erase(it);
+                }
+                m_watch_lock.unlock();
+                if(dir.empty()){ continue; }
+                if(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)){ invalidate_all(); }
+                else if(event->len > 0){ invalidate((dir == "/" ? std::string() : dir) + "/" + event->name); }
+                else{
+                    // 目录本身的属性变了，以'/'结尾的路径也指向它
+                    invalidate(dir);
+                    invalidate(dir == "/" ? dir : dir + "/");
+                }
+            }
+        }
+    }
+
+    private:
+    shard m_shards[SHARDS];
+    int m_fd;                  // inotify实例，不可用时为-1
+    locker m_watch_lock;       // 保护下面两个表
+    std::unordered_map<std::string, int> m_watched; // 已经监视的目录
+    std::unordered_map<int, std::string> m_dirs;    // 监视描述符对应的目录
+};
+
+#endif
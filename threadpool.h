@@ -5,71 +5,146 @@
 #ifndef THREADPOLL_H
 #define THREADPOLL_H
 
-#include <list>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdint.h>
+#include <atomic>
 
 /* 14章介绍的线程同步机制的包装类 */
 #include "locker.h"
+#include "log.h"
+#include "metrics.h"
+#include "mpmc_queue.h"
+#include "chase_lev_deque.h"
 
 /* 线程池类，将它定义为模板类是为了代码复用，模板参数T是任务类 */
+/* 请求队列是有界的无锁队列，入队和出队都不加锁；信号量只用于在队列空时让工作线程睡眠，
+   主线程只在有线程睡眠时才post，工作线程忙碌时入队不需要任何系统调用 */
+/* 工作窃取模式和亲和模式下每个线程有自己的队列，所有线程不再争抢同一个队头 */
 template <typename T>
 class threadpool
 {
 public:
-    /* thread_number是线程池中线程的数量，max_requests是请求队列中最多允许的、等待处理的请求数量 */
-    threadpool(int thread_number = 8, int max_requests = 10000);
+    /* 调度方式 */
+    enum SCHEDULE
+    {
+        SHARED_QUEUE = 0, // 所有线程共用一个请求队列
+        WORK_STEALING,    // 任务轮流分派给各线程，空闲的线程从其它线程窃取
+        AFFINITY          // 同一个任务对象总是分派给同一个线程，不窃取，它的数据一直留在那个核的缓存里
+    };
+
+    /* thread_number是线程池中线程的数量，max_requests是请求队列中最多允许的、等待处理的请求数量（向上取到2的幂）
+       工作窃取模式和亲和模式下每个线程的队列都能容纳max_requests个请求
+       pin_threads为true时把第i个线程绑定到本进程可用的第i个CPU上（线程比CPU多时循环使用） */
+    threadpool(int thread_number = 8, int max_requests = 10000, SCHEDULE schedule = SHARED_QUEUE, bool pin_threads = false);
     ~threadpool();
     bool append(T *request); // 往请求队列加任务
+    /* 一次加入一批任务，返回加入的个数k：加入的任务被排到requests的前k个，
+       requests[k]及以后是因为队列已满没有加入的任务，由调用者处理
+       亲和模式下只跳过目标线程的队列已满的任务，其它模式下遇到满的队列就停止
+       整批入队之后才唤醒睡眠的线程，最多唤醒min(n, 睡眠线程数)个 */
+    size_t append_batch(T **requests, size_t n);
+    /* 停止线程池：不再接受新任务，等待队列中的任务被取走，最多等待timeout_ms毫秒，
+       然后唤醒并回收所有线程，正在处理的任务总会处理完，到期时还在队列中的任务被丢弃
+       返回丢弃的任务数，不能与append并发调用，重复调用时直接返回0 */
+    size_t shutdown(int timeout_ms);
 
 private:
+    struct task{ T *request; long long queued_at; }; // 任务和它入队的时刻，用于统计排队时间
+
+    static const int STEAL_BATCH = 32; // 工作窃取模式下每次从收件队列移到双端队列的最大任务数
+    static const int POP_BATCH = 16;   // 共享队列模式和亲和模式下工作线程每次最多取出的任务数
+
+    /* 每个工作线程的状态，工作窃取模式下包括它自己的队列 */
+    /* 主线程把任务放进inbox，线程自己从inbox中成批取出任务放进deque再逐个处理，
+       deque是Chase-Lev双端队列，只有拥有者能放入，其它空闲线程可以从另一端窃取，也可以直接从inbox中取 */
+    struct worker_state
+    {
+        worker_state(threadpool *p, int i, int capacity) : pool(p), index(i), inbox(capacity), deque(STEAL_BATCH * 2), sleeping(false) {}
+        threadpool *pool;
+        int index;
+        mpmc_queue<task> inbox;     // 分派给这个线程的任务
+        chase_lev_deque<T> deque;   // 这个线程接下来要处理的任务，最早的在底部
+        std::atomic<bool> sleeping; // 是否已经登记要睡眠，唤醒者用exchange清除它，每次登记只会被唤醒一次
+        sem wake;                   // 这个线程在此睡眠
+    };
+
     /* 工作线程运行的函数，它不断从工作队列中取出任务并执行它 */
     static void *worker(void *arg);
     void run();
+    void run_local(worker_state *self);
+    int take_shared(task *tasks);
+    int find_tasks(worker_state *self, task *tasks);
+    bool wake(worker_state *target);
+    void cancel_sleep();
+    void handle(const task &t);
+    void handle_batch(const task *tasks, int count);
+    worker_state *target_of(T *request);
+    void pin(int index);
+    bool queues_empty() const;
+    void stop_threads(int count);
+    size_t drop_pending();
 
 private:
     int m_thread_number;        // 线程池中线程数
     int m_max_requests;         // 请求队列中允许的最大请求数
     pthread_t *m_threads;       // 描述线程池的数组，其大小为m_thread_number
-    std::list<T *> m_workqueue; // 请求队列
-    locker m_queuelocker;       // 保护请求队列的互斥锁
-    sem m_queuestat;            // 是否有任务需要处理
-    bool m_stop;                // 是否结束线程
+    mpmc_queue<task> m_workqueue; // 请求队列
+    std::atomic<int> m_sleepers; // 已经登记要睡眠、还没有被唤醒的工作线程数
+    sem m_queuestat;            // 队列空时工作线程在此睡眠
+    std::atomic<bool> m_stop;   // 是否结束线程
+    std::atomic<bool> m_accepting; // 是否还接受新任务
+    bool m_joined;              // 线程是否已经回收
+    std::atomic<size_t> m_dropped; // 线程池停止时已经取出但没有处理的任务数
+    SCHEDULE m_schedule;        // 调度方式
+    worker_state **m_workers;   // 各工作线程的状态
+    std::atomic<unsigned> m_next; // 工作窃取模式下下一个任务分派给哪个线程
+    bool m_pin_threads;         // 是否把线程绑定到CPU上
 };
 
 template <typename T>
-threadpool<T>::threadpool(int thread_number, int max_requests) : m_thread_number(thread_number), m_max_requests(max_requests), m_stop(false), m_threads(NULL)
+threadpool<T>::threadpool(int thread_number, int max_requests, SCHEDULE schedule, bool pin_threads) : m_thread_number(thread_number), m_max_requests(max_requests), m_threads(NULL),
+    m_workqueue((max_requests > 0 && schedule == SHARED_QUEUE) ? max_requests : 1), m_sleepers(0), m_stop(false), m_accepting(true), m_joined(false), m_dropped(0),
+    m_schedule(schedule), m_workers(NULL), m_next(0), m_pin_threads(pin_threads)
 {
     if ((thread_number <= 0) || (max_requests <= 0))
     {
         throw std::exception();
     }
 
-    m_threads = new pthread_t(m_thread_number); // 为线程池数组分配空间
-
-    if (!m_threads) // 分配失败时抛出异常
+    // 共享队列模式下各线程不需要自己的收件队列
+    m_workers = new worker_state *[thread_number];
+    for (int i = 0; i < thread_number; ++i)
     {
-        throw std::exception();
+        m_workers[i] = new worker_state(this, i, schedule == SHARED_QUEUE ? 1 : max_requests);
     }
 
-    // 创建thread_number个线程，并将它们都设置为脱离线程
+    m_threads = new pthread_t[m_thread_number]; // 为线程池数组分配空间
+
+    // 创建thread_number个线程，它们不是脱离线程，停止线程池时要逐个回收
     for (int i = 0; i < thread_number; ++i)
     {
-        printf("create the %dth thread\n", i);
+        LOG_DEBUG("create the %dth thread", i);
         /* C++中使用pthread_create函数时第3个参数要是static函数
         但是，static函数不能调用类中的动态成员函数、成员，所以可以给它传递一个this指针 */
-        if (pthread_create(m_threads + i, NULL, worker, this) != 0)
+        if (pthread_create(m_threads + i, NULL, worker, m_workers[i]) != 0)
         {
-            // pthread_create成功时返回0，其余情况抛出异常
+            // pthread_create成功时返回0，其余情况先回收已经创建的线程再抛出异常
+            stop_threads(i);
+            for (int j = 0; j < thread_number; ++j)
+            {
+                delete m_workers[j];
+            }
+            delete[] m_workers;
             delete[] m_threads;
             throw std::exception();
         }
-        if (pthread_detach(m_threads[i]))
+        if (m_pin_threads)
         {
-            // 脱离线程在退出时会自行释放其所占用的系统资源
-            delete[] m_threads;
-            throw std::exception();
+            pin(i);
         }
     }
 }
@@ -77,55 +152,438 @@ threadpool<T>::threadpool(int thread_number, int max_requests) : m_thread_number
 template <typename T>
 threadpool<T>::~threadpool()
 {
+    shutdown(0);
+    for (int i = 0; i < m_thread_number; ++i)
+    {
+        delete m_workers[i];
+    }
+    delete[] m_workers;
     delete[] m_threads;
-    m_stop = true;
 }
 
 template <typename T>
-bool threadpool<T>::append(T *request)
+size_t threadpool<T>::shutdown(int timeout_ms)
+{
+    if (m_joined)
+    {
+        return 0;
+    }
+    long long start = metrics::now_us();
+    long long deadline = start + timeout_ms * 1000LL;
+    m_accepting.store(false);
+    while (!queues_empty() && metrics::now_us() < deadline)
+    {
+        usleep(1000);
+    }
+    long long drained = metrics::now_us();
+    stop_threads(m_thread_number);
+    size_t dropped = drop_pending();
+    LOG_INFO("threadpool stopped: drained for %lld ms, joined threads in %lld ms, %lu tasks dropped",
+             (drained - start) / 1000, (metrics::now_us() - drained) / 1000, (unsigned long)dropped);
+    return dropped;
+}
+
+/* 所有队列中都没有等待处理的任务，只在停止线程池时调用 */
+template <typename T>
+bool threadpool<T>::queues_empty() const
 {
-    // 操作工作队列时一定要加锁，因为它被所有线程共享
-    m_queuelocker.lock();
-    if (m_workqueue.size() > m_max_requests)
+    if (m_workqueue.size_approx() > 0)
     {
-        m_queuelocker.unlock();
         return false;
     }
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_queuestat.post();
+    for (int i = 0; i < m_thread_number; ++i)
+    {
+        if (m_workers[i]->inbox.size_approx() > 0 || !m_workers[i]->deque.empty())
+        {
+            return false;
+        }
+    }
     return true;
 }
 
+/* 让前count个线程退出并回收它们 */
+/* 线程在处理每个任务之前检查m_stop，正在处理的任务总会处理完；每个线程在m_stop置位之后最多再睡眠一次，
+   所以给共享的信号量post线程数次、给每个线程自己的信号量各post一次，就能保证它们都醒来 */
+template <typename T>
+void threadpool<T>::stop_threads(int count)
+{
+    m_stop.store(true);
+    for (int i = 0; i < count; ++i)
+    {
+        m_queuestat.post();
+        m_workers[i]->wake.post();
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        pthread_join(m_threads[i], NULL);
+    }
+    m_joined = true;
+}
+
+/* 线程都已退出，取出各队列中剩下的任务并返回它们的个数，这些任务不会再被处理 */
+template <typename T>
+size_t threadpool<T>::drop_pending()
+{
+    size_t dropped = m_dropped.load();
+    task t;
+    while (m_workqueue.pop(&t))
+    {
+        ++dropped;
+    }
+    for (int i = 0; i < m_thread_number; ++i)
+    {
+        while (m_workers[i]->deque.pop(&t.request, &t.queued_at) || m_workers[i]->inbox.pop(&t))
+        {
+            ++dropped;
+        }
+    }
+    return dropped;
+}
+
+template <typename T>
+bool threadpool<T>::append(T *request)
+{
+    return append_batch(&request, 1) == 1;
+}
+
+template <typename T>
+size_t threadpool<T>::append_batch(T **requests, size_t n)
+{
+    if (!m_accepting.load(std::memory_order_relaxed))
+    {
+        return 0; // 线程池正在停止
+    }
+    long long now = metrics::now_us();
+    size_t count = 0;
+    if (m_schedule != SHARED_QUEUE)
+    {
+        unsigned first = m_next.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < n; ++i)
+        {
+            task t = { requests[i], now };
+            if (target_of(requests[i])->inbox.push(t))
+            {
+                // 加入的任务与前面第一个没有加入的任务交换位置，没有加入的任务就都排到了后面
+                T *accepted = requests[i];
+                requests[i] = requests[count];
+                requests[count++] = accepted;
+            }
+            else if (m_schedule != AFFINITY)
+            {
+                break; // 轮流分派时轮到的线程队列已满，说明各线程都很忙，后面的任务也不再加入
+            }
+            // 亲和模式下只跳过这个任务，其它任务的目标线程可能还有空位
+        }
+        if (count == 0)
+        {
+            return 0;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst); // 与run_local中登记和复查之间的全屏障配对
+        if (m_schedule == AFFINITY)
+        {
+            // 只有目标线程能处理分派给它的任务，逐个唤醒；已经唤醒过的线程sleeping为false，不会重复post
+            for (size_t i = 0; i < count; ++i)
+            {
+                wake(target_of(requests[i]));
+            }
+            return count;
+        }
+        // 任务是从first开始轮流分派的，先唤醒这些目标线程，它们忙时改为唤醒其它睡眠的线程来窃取
+        size_t wanted = count < (size_t)m_thread_number ? count : m_thread_number;
+        size_t woken = 0;
+        for (int i = 0; i < m_thread_number && woken < wanted && m_sleepers.load(std::memory_order_relaxed) > 0; ++i)
+        {
+            if (wake(m_workers[(first + i) % m_thread_number]))
+            {
+                ++woken;
+            }
+        }
+        return count;
+    }
+
+    task tasks[POP_BATCH];
+    while (count < n)
+    {
+        size_t batch = 0;
+        for (; batch < (size_t)POP_BATCH && count + batch < n; ++batch)
+        {
+            tasks[batch].request = requests[count + batch];
+            tasks[batch].queued_at = now;
+        }
+        size_t pushed = 0;
+        while (pushed < batch)
+        {
+            size_t k = m_workqueue.push_batch(tasks + pushed, batch - pushed);
+            if (k == 0)
+            {
+                break; // 队列已满
+            }
+            pushed += k;
+        }
+        count += pushed;
+        if (pushed < batch)
+        {
+            break;
+        }
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+    // 入队和检查睡眠线程数之间的全屏障与run中登记和复查之间的全屏障配对：
+    // 要么这里看到了登记，要么工作线程复查时看到了这些任务，不会两边都错过
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // 一次认领至多count个睡眠的线程并逐个唤醒，每个登记只会被认领一次，所以不会多post
+    int sleepers = m_sleepers.load(std::memory_order_relaxed);
+    int claim = 0;
+    while (sleepers > 0)
+    {
+        claim = (size_t)sleepers < count ? sleepers : (int)count;
+        if (m_sleepers.compare_exchange_weak(sleepers, sleepers - claim))
+        {
+            break;
+        }
+        claim = 0;
+    }
+    for (int i = 0; i < claim; ++i)
+    {
+        m_queuestat.post();
+    }
+    return count;
+}
+
+/* 工作窃取模式下轮流选择线程；亲和模式下按对象的地址选择，
+   任务对象是同一个数组中的元素（如users + sockfd）时相当于按下标取模，同一个连接总是落在同一个线程上 */
+template <typename T>
+typename threadpool<T>::worker_state *threadpool<T>::target_of(T *request)
+{
+    if (m_schedule == AFFINITY)
+    {
+        return m_workers[((uintptr_t)request / sizeof(T)) % m_thread_number];
+    }
+    return m_workers[m_next.fetch_add(1, std::memory_order_relaxed) % m_thread_number];
+}
+
+/* 把第index个线程绑定到本进程可用的CPU中的一个上，失败时只记录警告，线程照常运行 */
+template <typename T>
+void threadpool<T>::pin(int index)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0)
+    {
+        LOG_WARN("sched_getaffinity failed, errno is: %d, thread %d is not pinned", errno, index);
+        return;
+    }
+    int nth = index % CPU_COUNT(&allowed);
+    int cpu = 0;
+    for (; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &allowed) && nth-- == 0)
+        {
+            break;
+        }
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(m_threads[index], sizeof(set), &set);
+    if (ret != 0)
+    {
+        LOG_WARN("pthread_setaffinity_np failed, error is: %d, thread %d is not pinned", ret, index);
+        return;
+    }
+    LOG_DEBUG("pin the %dth thread to cpu %d", index, cpu);
+}
+
 /* static可以只在声明里写，实现部分可以不加static关键字了 */
 template <typename T>
 void *threadpool<T>::worker(void *arg)
 {
-    threadpool *pool = (threadpool *)arg; // arg是this指针，这里将它从void*转换回threadpool*
-    pool->run();
+    worker_state *self = (worker_state *)arg; // arg是这个线程的状态，其中有this指针
+    threadpool *pool = self->pool;
+    if (pool->m_schedule == SHARED_QUEUE)
+    {
+        pool->run();
+    }
+    else
+    {
+        pool->run_local(self);
+    }
     return pool;
 }
 
 template <typename T>
 void threadpool<T>::run()
 {
+    task tasks[POP_BATCH];
+    while (!m_stop)
+    {
+        int count = take_shared(tasks);
+        if (count == 0)
+        {
+            // 队列空了，先登记再复查一次，复查仍为空才真正睡眠
+            m_sleepers.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            count = take_shared(tasks);
+            if (count == 0)
+            {
+                // 被信号打断时接着等，登记只对应一次post
+                while (!m_queuestat.wait())
+                {
+                }
+                continue;
+            }
+            cancel_sleep();
+        }
+        handle_batch(tasks, count);
+    }
+}
+
+/* 逐个处理取出的一批任务，线程池停止后剩下的不再处理，计入丢弃的任务数 */
+template <typename T>
+void threadpool<T>::handle_batch(const task *tasks, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        if (m_stop.load(std::memory_order_relaxed))
+        {
+            m_dropped.fetch_add(count - i);
+            return;
+        }
+        handle(tasks[i]);
+    }
+}
+
+/* 从共享队列中取出一批任务，取出的数量不超过队列长度除以线程数，免得一个线程拿走别的线程本可以并行处理的任务 */
+template <typename T>
+int threadpool<T>::take_shared(task *tasks)
+{
+    size_t limit = m_workqueue.size_approx() / m_thread_number;
+    if (limit < 1)
+    {
+        limit = 1;
+    }
+    else if (limit > (size_t)POP_BATCH)
+    {
+        limit = POP_BATCH;
+    }
+    return m_workqueue.pop_batch(tasks, limit);
+}
+
+template <typename T>
+void threadpool<T>::handle(const task &t)
+{
+    metrics::instance()->observe(HISTOGRAM_QUEUE_WAIT, metrics::now_us() - t.queued_at);
+    if (t.request)
+    {
+        t.request->process();
+    }
+}
+
+/* 工作窃取模式和亲和模式下工作线程的主循环，登记睡眠和复查的方式与run相同，只是登记在线程自己的sleeping上 */
+template <typename T>
+void threadpool<T>::run_local(worker_state *self)
+{
+    task tasks[POP_BATCH];
     while (!m_stop)
     {
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if (m_workqueue.empty())
+        int count = find_tasks(self, tasks);
+        if (count == 0)
+        {
+            self->sleeping.store(true);
+            m_sleepers.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            count = find_tasks(self, tasks);
+            if (count == 0)
+            {
+                while (!self->wake.wait())
+                {
+                }
+                continue;
+            }
+            // 复查时拿到了任务，撤销登记；登记已经被唤醒者清除时，要消耗掉它post的信号量
+            if (self->sleeping.exchange(false))
+            {
+                m_sleepers.fetch_sub(1);
+            }
+            else
+            {
+                while (!self->wake.wait())
+                {
+                }
+            }
+        }
+        handle_batch(tasks, count);
+    }
+}
+
+/* 依次从自己的双端队列、自己的收件队列和其它线程的队列中找一个任务，返回找到的个数 */
+/* 亲和模式下一次从自己的收件队列中取出一批，不经过双端队列，也不窃取 */
+template <typename T>
+int threadpool<T>::find_tasks(worker_state *self, task *tasks)
+{
+    if (m_schedule == AFFINITY)
+    {
+        return self->inbox.pop_batch(tasks, POP_BATCH);
+    }
+    task *t = tasks;
+    if (self->deque.pop(&t->request, &t->queued_at))
+    {
+        return 1;
+    }
+    if (self->inbox.pop(t))
+    {
+        // 再从收件队列中取一批放进双端队列，这样本线程忙时其它线程可以窃取它们
+        // 倒着放入，使最早的任务在底部，本线程按到达的顺序处理，窃取者拿走的是最晚到达的
+        task batch[STEAL_BATCH];
+        int count = self->inbox.pop_batch(batch, STEAL_BATCH);
+        // 只有本线程往双端队列里放，刚才pop失败说明它是空的，而容量是STEAL_BATCH的两倍，一定放得下
+        while (count > 0)
+        {
+            --count;
+            self->deque.push(batch[count].request, batch[count].queued_at);
+        }
+        return 1;
+    }
+    for (int i = 1; i < m_thread_number; ++i)
+    {
+        worker_state *victim = m_workers[(self->index + i) % m_thread_number];
+        if (victim->deque.steal(&t->request, &t->queued_at) || victim->inbox.pop(t))
         {
-            m_queuelocker.unlock();
-            continue;
+            return 1;
         }
-        T *request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
-        if (!request)
+    }
+    return 0;
+}
+
+/* 目标线程已经登记睡眠时唤醒它并返回true */
+template <typename T>
+bool threadpool<T>::wake(worker_state *target)
+{
+    if (!target->sleeping.load(std::memory_order_relaxed) || !target->sleeping.exchange(false))
+    {
+        return false;
+    }
+    m_sleepers.fetch_sub(1);
+    target->wake.post();
+    return true;
+}
+
+/* 登记睡眠之后复查时拿到了任务，撤销登记 */
+/* 登记已经被append认领时，对应的post一定会到来，要把它消耗掉，否则以后会有一次空唤醒 */
+template <typename T>
+void threadpool<T>::cancel_sleep()
+{
+    int sleepers = m_sleepers.load(std::memory_order_relaxed);
+    while (sleepers > 0 && !m_sleepers.compare_exchange_weak(sleepers, sleepers - 1))
+    {
+    }
+    if (sleepers == 0)
+    {
+        while (!m_queuestat.wait())
         {
-            continue;
         }
-        request->process();
     }
 }
 